@@ -0,0 +1,140 @@
+#include "acyclic-builder.h"
+#include <algorithm>
+
+using namespace std;
+
+acyclic_builder_t::acyclic_builder_t()
+  : nodes(1), path(1, 0),
+    registry(0, same_node_t{this}, same_node_t{this})
+{
+}
+
+size_t
+acyclic_builder_t::same_node_t::operator()(uint32_t n) const
+{
+  const node_t &node = builder->nodes[n];
+  size_t h = node.final;
+  for(auto &edge : node.edges)
+  {
+    h = h * 1000003 + (size_t)(uint32_t)edge.first;
+    h = h * 1000003 + edge.second;
+  }
+  return h;
+}
+
+bool
+acyclic_builder_t::same_node_t::operator()(uint32_t a, uint32_t b) const
+{
+  const node_t &x = builder->nodes[a];
+  const node_t &y = builder->nodes[b];
+  return x.final == y.final && x.edges == y.edges;
+}
+
+void
+acyclic_builder_t::add(const vector<int> &p)
+{
+  starts.push_back(tags.size());
+  tags.insert(tags.end(), p.begin(), p.end());
+}
+
+uint32_t
+acyclic_builder_t::newNode()
+{
+  if(unused.empty())
+  {
+    nodes.emplace_back();
+    return (uint32_t)(nodes.size() - 1);
+  }
+  uint32_t n = unused.back();
+  unused.pop_back();
+  return n;
+}
+
+// Registers the nodes below `depth` on the last path, deepest first, or
+// replaces them with the equivalent node already registered.
+void
+acyclic_builder_t::settle(size_t depth)
+{
+  for(size_t d = path.size() - 1; d > depth; d--)
+  {
+    const uint32_t n = path[d];
+    auto it = registry.insert(n);
+    if(!it.second)
+    {
+      nodes[path[d-1]].edges.back().second = *it.first;
+      nodes[n] = node_t();
+      unused.push_back(n);
+    }
+  }
+  path.resize(depth + 1);
+}
+
+void
+acyclic_builder_t::insert(const int *p, size_t len)
+{
+  const int *prev = tags.data() + last;
+  size_t common = 0;
+  while(common < len && common < last_len && p[common] == prev[common])
+    common++;
+  settle(common);
+  for(size_t i = common; i < len; i++)
+  {
+    uint32_t n = newNode();
+    nodes[path.back()].edges.emplace_back(p[i], n);
+    path.push_back(n);
+  }
+  nodes[path.back()].final = true;
+  last = (size_t)(p - tags.data());
+  last_len = len;
+}
+
+void
+acyclic_builder_t::emit(Transducer *t, int state)
+{
+  const size_t count = starts.size();
+  auto path_end = [this, count](size_t i) {
+    return (i + 1 < count ? starts[i+1] : tags.size());
+  };
+  vector<size_t> order(count);
+  for(size_t i = 0; i < count; i++)
+    order[i] = i;
+  sort(order.begin(), order.end(), [this, &path_end](size_t a, size_t b) {
+    return lexicographical_compare(tags.data() + starts[a], tags.data() + path_end(a),
+                                   tags.data() + starts[b], tags.data() + path_end(b));
+  });
+  for(size_t i : order)
+    insert(tags.data() + starts[i], path_end(i) - starts[i]);
+  settle(0);
+  registry.clear();
+
+  vector<int> states(nodes.size(), -1);
+  states[0] = state;
+  if(nodes[0].final)
+    t->setFinal(state);
+  vector<uint32_t> todo(1, 0);
+  while(!todo.empty())
+  {
+    const uint32_t n = todo.back();
+    todo.pop_back();
+    for(auto &edge : nodes[n].edges)
+    {
+      if(states[edge.second] == -1)
+      {
+        states[edge.second] = t->insertNewSingleTransduction(edge.first, states[n]);
+        if(nodes[edge.second].final)
+          t->setFinal(states[edge.second]);
+        todo.push_back(edge.second);
+      }
+      else
+        t->linkStates(states[n], states[edge.second], edge.first);
+    }
+  }
+
+  // start over, so the builder can be used again
+  tags.clear();
+  starts.clear();
+  nodes.assign(1, node_t());
+  unused.clear();
+  path.assign(1, 0);
+  last = last_len = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef _LEXD_ACYCLIC_BUILDER_H_
+#define _LEXD_ACYCLIC_BUILDER_H_
+
+#include <lttoolbox/transducer.h>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+// Builds the minimal automaton for a finite set of paths (sequences of
+// symbol pair ids) without first building a path per entry. The paths
+// are sorted and then added one at a time, following Daciuk et al.
+// (2000): once the next path branches off, the states only the previous
+// one reached are final, and each is merged with an equivalent state
+// if one has been seen, so the automaton stays close to its minimal
+// size the whole time.
+class acyclic_builder_t
+{
+  private:
+    struct node_t {
+      bool final = false;
+      // (tag, node), in order of tag
+      std::vector<std::pair<int, uint32_t>> edges;
+    };
+    // the paths as added, one after the other
+    std::vector<int> tags;
+    std::vector<size_t> starts;
+
+    std::vector<node_t> nodes;
+    std::vector<uint32_t> unused;
+    // the nodes along the last path inserted, from the root
+    std::vector<uint32_t> path;
+    size_t last = 0;
+    size_t last_len = 0;
+    // nodes that won't change any more, hashed and compared by final
+    // flag and edges
+    struct same_node_t {
+      const acyclic_builder_t *builder;
+      size_t operator()(uint32_t n) const;
+      bool operator()(uint32_t a, uint32_t b) const;
+    };
+    std::unordered_set<uint32_t, same_node_t, same_node_t> registry;
+
+    uint32_t newNode();
+    void settle(size_t depth);
+    void insert(const int *p, size_t len);
+  public:
+    acyclic_builder_t();
+    // the registry points back at the builder
+    acyclic_builder_t(const acyclic_builder_t&) = delete;
+    acyclic_builder_t& operator=(const acyclic_builder_t&) = delete;
+    void add(const std::vector<int> &p);
+    bool empty() const { return starts.empty(); }
+    // Adds the paths to t, leaving from `state`, and empties the builder.
+    void emit(Transducer *t, int state);
+};
+
+#endif
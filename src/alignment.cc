@@ -0,0 +1,116 @@
+#include "alignment.h"
+#include <algorithm>
+
+using namespace std;
+
+// below this many cells, aligning is cheaper than looking it up
+#define ALIGN_CACHE_CELLS 1024
+// the table is given back after an alignment bigger than this
+#define ALIGN_KEEP_CELLS (1 << 20)
+// the cache is emptied rather than grow past this
+#define ALIGN_CACHE_BYTES (8 << 20)
+
+void
+aligner_t::run(const vector<int> &a, const vector<int> &b, unsigned int sub_cost)
+{
+  const size_t len1 = a.size();
+  const size_t len2 = b.size();
+  const size_t width = len2 + 1;
+  // the strings are compared from the end, so b is walked backwards
+  reversed.assign(b.rbegin(), b.rend());
+  // the buffers only ever grow, so that they needn't be cleared
+  if(prev.size() < width)
+  {
+    prev.resize(width);
+    cur.resize(width);
+    subs.resize(width);
+  }
+  if(path.size() < (len1 + 1) * width)
+    path.resize((len1 + 1) * width);
+  for(size_t j = 0; j <= len2; j++)
+  {
+    prev[j] = (unsigned int)j;
+    path[j] = Ins;
+  }
+  for(size_t i = 1; i <= len1; i++)
+  {
+    const int sym = a[len1 - i];
+    op_t *row = path.data() + i * width;
+    cur[0] = (unsigned int)i;
+    row[0] = Del;
+    // every array here is 32 bits wide and none overlap, so that this
+    // loop can be vectorized
+    const unsigned int *__restrict__ p = prev.data();
+    const int *__restrict__ r = reversed.data();
+    unsigned int *__restrict__ c = cur.data();
+    unsigned int *__restrict__ s = subs.data();
+    for(size_t j = 1; j <= len2; j++)
+    {
+      const unsigned int sub = p[j-1] + (sym == r[j-1] ? 0 : sub_cost);
+      const unsigned int del = p[j] + 1;
+      c[j] = (sub <= del ? sub : del);
+      s[j] = (sub <= del);
+    }
+    // substitution wins ties with insertion, and insertion with deletion
+    for(size_t j = 1; j <= len2; j++)
+    {
+      const unsigned int ins = c[j-1] + 1;
+      const bool take = (ins + s[j] <= c[j]);
+      c[j] = (take ? ins : c[j]);
+      row[j] = (take ? Ins : (s[j] ? Sub : Del));
+    }
+    prev.swap(cur);
+  }
+
+  ops.clear();
+  for(size_t x = len1, y = len2; x > 0 || y > 0;)
+  {
+    const op_t op = path[x * width + y];
+    ops.push_back(op);
+    if(op != Ins)
+      x--;
+    if(op != Del)
+      y--;
+  }
+  if(path.size() > ALIGN_KEEP_CELLS)
+    vector<op_t>().swap(path);
+}
+
+const vector<aligner_t::op_t> &
+aligner_t::align(const vector<int> &a, const vector<int> &b, unsigned int sub_cost)
+{
+  ops.clear();
+  if(a.empty() || b.empty())
+  {
+    ops.assign(max(a.size(), b.size()), (a.empty() ? Ins : Del));
+    return ops;
+  }
+  if(a == b)
+  {
+    ops.assign(a.size(), Sub);
+    return ops;
+  }
+  if(a.size() * b.size() < ALIGN_CACHE_CELLS)
+  {
+    run(a, b, sub_cost);
+    return ops;
+  }
+  string key((const char*)&sub_cost, sizeof(sub_cost));
+  const size_t len1 = a.size();
+  key.append((const char*)&len1, sizeof(len1));
+  key.append((const char*)a.data(), a.size() * sizeof(int));
+  key.append((const char*)b.data(), b.size() * sizeof(int));
+  auto it = cache.find(key);
+  if(it != cache.end())
+    return it->second;
+  run(a, b, sub_cost);
+  // the key, the steps and something for the node holding them
+  const size_t bytes = key.size() + ops.size() + 64;
+  if(cache_bytes + bytes > ALIGN_CACHE_BYTES)
+  {
+    cache.clear();
+    cache_bytes = 0;
+  }
+  cache_bytes += bytes;
+  return cache.emplace(key, ops).first->second;
+}
@@ -0,0 +1,46 @@
+#ifndef _LEXD_ALIGNMENT_H_
+#define _LEXD_ALIGNMENT_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Levenshtein alignment of the two sides of a lexicon entry, for -a and
+// -c. Ties go SUB > INS > DEL counting from the end of the strings, as
+// in hfst-lexc, so that 000abc:xyz000 is preferred over abc000:000xyz.
+//
+// The table of choices is the full (len1+1)x(len2+1) grid, but at a
+// byte per cell on the heap rather than on the stack, with only two
+// rows of costs kept; it's given back after anything unusually long.
+// Each row is filled in two passes: substitution and deletion only need
+// the row before, so that pass has no dependencies between cells and
+// can be vectorized; insertion is then settled left to right.
+// Alignments of longer strings are kept, keyed by both strings, so an
+// entry that turns up in several lexicons or collations is only aligned
+// once; the cache is emptied whenever it would grow past a few
+// megabytes.
+class aligner_t
+{
+  public:
+    enum op_t : char { Sub, Ins, Del };
+  private:
+    std::vector<unsigned int> prev, cur;
+    // whether each cell of the row is best reached by substitution,
+    // before insertion is considered
+    std::vector<unsigned int> subs;
+    std::vector<int> reversed;
+    std::vector<op_t> path;
+    std::vector<op_t> ops;
+    std::unordered_map<std::string, std::vector<op_t>> cache;
+    // roughly what the cache takes up
+    size_t cache_bytes = 0;
+
+    void run(const std::vector<int> &a, const std::vector<int> &b, unsigned int sub_cost);
+  public:
+    // The steps from the start of a and b to their ends: Sub takes a
+    // symbol from each, Ins one from b and Del one from a. Valid until
+    // the next call.
+    const std::vector<op_t> &align(const std::vector<int> &a, const std::vector<int> &b, unsigned int sub_cost);
+};
+
+#endif
@@ -2,42 +2,80 @@
 #include <iostream>
 #include <string>
 #include <cstdint>
+#include <memory>
 using namespace std;
 using namespace icu;
 
-charspan_iter::charspan_iter(const UnicodeString &s)
-  : _status(U_ZERO_ERROR), s(&s)
-{
-  it = BreakIterator::createCharacterInstance(Locale::getDefault(), _status);
-  if(U_FAILURE(_status))
+namespace {
+  struct break_cache
+  {
+    unique_ptr<BreakIterator> it;
+    const UnicodeString *text = nullptr;
+  };
+  thread_local break_cache cache;
+
+  BreakIterator &break_iterator(const UnicodeString &s)
   {
-    cerr << "Failed to create character iterator with code " << _status << endl;
-    exit(1);
+    if(!cache.it)
+    {
+      UErrorCode status = U_ZERO_ERROR;
+      cache.it.reset(BreakIterator::createCharacterInstance(Locale::getDefault(), status));
+      if(U_FAILURE(status))
+      {
+        cerr << "Failed to create character iterator with code " << status << endl;
+        exit(1);
+      }
+    }
+    if(cache.text != &s)
+    {
+      cache.it->setText(s);
+      cache.text = &s;
+    }
+    return *cache.it;
+  }
+
+  // No grapheme cluster rule joins two code points below U+0300 except
+  // CR LF (GB3), so a boundary between them can be assumed.
+  inline bool simple_pair(UChar a, UChar b)
+  {
+    return a < 0x300 && b < 0x300 && !(a == '\r' && b == '\n');
   }
-  it->setText(s);
-  _span.first = it->first();
-  _span.second = it->next();
 }
 
-charspan_iter::charspan_iter(const charspan_iter &other)
-  : _status(other._status), s(other.s), _span(other._span)
+int
+charspan_iter::following(const UnicodeString &s, int pos)
 {
-  it = other.it->clone();
+  const int len = s.length();
+  if(pos >= len)
+    return BreakIterator::DONE;
+  if(pos + 1 == len ? s[pos] < 0x300 : simple_pair(s[pos], s[pos+1]))
+    return pos + 1;
+  return break_iterator(s).following(pos);
 }
 
-charspan_iter::~charspan_iter()
+int
+charspan_iter::preceding(const UnicodeString &s, int pos)
 {
-  delete it;
+  if(pos <= 0)
+    return BreakIterator::DONE;
+  if(pos == 1 ? s[0] < 0x300 : simple_pair(s[pos-2], s[pos-1]))
+    return pos - 1;
+  return break_iterator(s).preceding(pos);
 }
 
-charspan_iter rev_charspan_iter(const UnicodeString &s)
+charspan_iter::charspan_iter(const UnicodeString &s)
+  : s(&s)
 {
-  return --charspan_iter(s).end();
+  // a new iteration may be over a different string living at the same
+  // address as the one the shared iterator last saw
+  cache.text = nullptr;
+  _span.first = 0;
+  _span.second = following(s, 0);
 }
 
-const UErrorCode &charspan_iter::status() const
+charspan_iter rev_charspan_iter(const UnicodeString &s)
 {
-    return _status;
+  return --charspan_iter(s).end();
 }
 
 const pair<int, int> &charspan_iter::operator*() const
@@ -47,44 +85,29 @@ const pair<int, int> &charspan_iter::operator*() const
 
 charspan_iter charspan_iter::operator++(int)
 {
-  if (at_end()) return *this;
-  auto other = charspan_iter(*this);
-  other._span = make_pair(other._span.second, other.it->next());
-  if(other._span.first == other._span.second)
-    other._span.second = other.it->next();
+  auto other = *this;
+  ++*this;
   return other;
 }
 
 charspan_iter &charspan_iter::operator++()
 {
   if (!at_end())
-  {
-    _span = make_pair(_span.second, it->next());
-    if(_span.first == _span.second)
-      _span.second = it->next();
-  }
+    _span = make_pair(_span.second, following(*s, _span.second));
   return *this;
 }
 
 charspan_iter &charspan_iter::operator--()
 {
-  if(*this != begin())
-  {
-    _span = make_pair(it->previous(), _span.first);
-    if(_span.first == _span.second)
-      _span.first = it->previous();
-  }
+  if(_span.first > 0)
+    _span = make_pair(preceding(*s, _span.first), _span.first);
   return *this;
 }
 
 charspan_iter charspan_iter::operator--(int)
 {
-  if(*this == begin())
-    return *this;
-  auto other = charspan_iter(*this);
-  other._span = make_pair(other.it->previous(), other._span.first);
-  if(other._span.first == other._span.second)
-    other._span.first = other.it->previous();
+  auto other = *this;
+  --*this;
   return other;
 }
 
@@ -115,8 +138,8 @@ charspan_iter charspan_iter::begin()
 
 charspan_iter charspan_iter::end()
 {
-  charspan_iter cs_it(*s);
-  cs_it._span.first = cs_it.it->last();
+  charspan_iter cs_it(*this);
+  cs_it._span.first = s->length();
   cs_it._span.second = BreakIterator::DONE;
   return cs_it;
 }
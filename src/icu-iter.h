@@ -9,21 +9,24 @@
 #include <map>
 #include <string>
 
+// Iterates over the grapheme clusters of a string as [first, second)
+// spans of UTF-16 offsets. The iterator itself is just a string pointer
+// and a span, so copying it is free. Boundaries between two code points
+// below U+0300 (other than CR LF) are found without consulting ICU;
+// anything else goes through a single BreakIterator kept per thread.
 class charspan_iter
 {
   private:
-    icu::BreakIterator* it;
-    UErrorCode _status;
     const icu::UnicodeString *s;
     std::pair<int, int> _span;
+    static int following(const icu::UnicodeString &s, int pos);
+    static int preceding(const icu::UnicodeString &s, int pos);
   public:
     charspan_iter(const icu::UnicodeString &s);
-    charspan_iter(const charspan_iter &other);
+    charspan_iter(const charspan_iter &other) = default;
+    charspan_iter &operator=(const charspan_iter &other) = default;
     friend charspan_iter rev_charspan_iter(const icu::UnicodeString &s);
-    
-    ~charspan_iter();
-    
-    const UErrorCode &status() const;
+
     const std::pair<int, int> &operator*() const;
     charspan_iter operator++(int);
     charspan_iter &operator++();
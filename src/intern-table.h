@@ -0,0 +1,116 @@
+#ifndef _LEXD_INTERN_TABLE_H_
+#define _LEXD_INTERN_TABLE_H_
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Interns values of K (compared with == and hashed with std::hash<K>)
+// as dense ids handed out in order of first appearance, the way
+// name_table does for names. Every intern() hashes the value and
+// compares it with whatever shares its hash, so callers keep the id
+// with the value and look things up by it rather than interning again.
+template<typename K>
+class intern_table
+{
+  public:
+    struct id_t {
+      uint32_t i;
+      bool operator==(id_t other) const { return i == other.i; }
+      bool operator!=(id_t other) const { return i != other.i; }
+    };
+  private:
+    struct slot_t {
+      uint32_t hash;
+      uint32_t id; // id + 1, 0 for an empty slot
+    };
+    std::vector<K> keys;
+    std::vector<slot_t> slots = std::vector<slot_t>(64, slot_t {0, 0});
+
+    void grow()
+    {
+      std::vector<slot_t> bigger(slots.size() * 2, slot_t {0, 0});
+      const size_t mask = bigger.size() - 1;
+      for(const slot_t &s : slots)
+      {
+        if(s.id == 0)
+          continue;
+        size_t pos = s.hash & mask;
+        while(bigger[pos].id != 0)
+          pos = (pos + 1) & mask;
+        bigger[pos] = s;
+      }
+      slots.swap(bigger);
+    }
+  public:
+    id_t intern(const K &key)
+    {
+      const size_t full = std::hash<K>()(key);
+      const uint32_t h = (uint32_t)(full ^ (full >> 32));
+      const size_t mask = slots.size() - 1;
+      size_t pos = h & mask;
+      for(; slots[pos].id != 0; pos = (pos + 1) & mask)
+      {
+        const slot_t &s = slots[pos];
+        if(s.hash == h && keys[s.id - 1] == key)
+          return id_t {s.id - 1};
+      }
+      const uint32_t id = (uint32_t)keys.size();
+      keys.push_back(key);
+      slots[pos] = slot_t {h, id + 1};
+      // keep the load factor under a half
+      if(keys.size() * 2 > slots.size())
+        grow();
+      return id_t {id};
+    }
+    const K &operator[](id_t id) const { return keys[id.i]; }
+    size_t size() const { return keys.size(); }
+};
+
+// A map from interned ids to T stored as a flat array. find() returns
+// nullptr for ids that have never been assigned.
+template<typename T>
+class id_map
+{
+  private:
+    std::vector<T> values;
+    std::vector<bool> present;
+  public:
+    template<typename Id>
+    T *find(Id id)
+    {
+      return (id.i < present.size() && present[id.i]) ? &values[id.i] : nullptr;
+    }
+    template<typename Id>
+    T &operator[](Id id)
+    {
+      if(id.i >= values.size())
+      {
+        values.resize(id.i + 1);
+        present.resize(id.i + 1, false);
+      }
+      present[id.i] = true;
+      return values[id.i];
+    }
+    // hands every value that was assigned to f, then forgets them all
+    template<typename F>
+    void clear(F f)
+    {
+      for(size_t i = 0; i < values.size(); i++)
+        if(present[i])
+          f(values[i]);
+      values.clear();
+      present.clear();
+    }
+    template<typename Id>
+    void erase(Id id)
+    {
+      if(id.i < present.size())
+      {
+        present[id.i] = false;
+        values[id.i] = T();
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "ir.h"
+#include <cstring>
+
+using namespace std;
+using namespace icu;
+
+// FNV-1a, 64-bit
+uint64_t
+ir_hash(const char *data, size_t len, uint64_t seed)
+{
+  uint64_t h = seed;
+  for(size_t i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void
+ir_writer::u(uint64_t v)
+{
+  while(v >= 0x80)
+  {
+    buf += (char)((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  buf += (char)v;
+}
+
+void
+ir_writer::s(int64_t v)
+{
+  u(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+void
+ir_writer::str(const UnicodeString &s)
+{
+  u((uint64_t)s.length());
+  for(int32_t i = 0; i < s.length(); i++)
+    u(s[i]);
+}
+
+ir_reader::ir_reader(const char *data, size_t len)
+  : p((const unsigned char*)data), end((const unsigned char*)data + len)
+{
+}
+
+uint64_t
+ir_reader::u()
+{
+  uint64_t v = 0;
+  for(unsigned int shift = 0; ok && shift < 64; shift += 7)
+  {
+    if(p == end)
+      break;
+    unsigned char b = *p++;
+    v |= (uint64_t)(b & 0x7F) << shift;
+    if(!(b & 0x80))
+      return v;
+  }
+  ok = false;
+  return 0;
+}
+
+int64_t
+ir_reader::s()
+{
+  uint64_t v = u();
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+UnicodeString
+ir_reader::str()
+{
+  uint64_t len = u();
+  UnicodeString s;
+  if(len > remaining())
+  {
+    ok = false;
+    return s;
+  }
+  for(uint64_t i = 0; ok && i < len; i++)
+    s += (UChar)u();
+  return s;
+}
+
+bool
+ir_reader::raw(const char *expect, size_t len)
+{
+  if(!ok || remaining() < len || memcmp(p, expect, len) != 0)
+    ok = false;
+  else
+    p += len;
+  return ok;
+}
@@ -0,0 +1,55 @@
+#ifndef _LEXD_IR_H_
+#define _LEXD_IR_H_
+
+#include <unicode/unistr.h>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Encoding helpers for the precompiled intermediate format written by
+// --emit-ir. Integers are LEB128 varints (signed ones zigzag-encoded),
+// strings are a length followed by their UTF-16 code units as varints.
+//
+// File layout:
+//   "LEXDIR" version source-hash payload-hash payload-length payload
+// The payload itself is laid out by LexdCompiler::writeIR().
+
+#define LEXD_IR_MAGIC "LEXDIR"
+#define LEXD_IR_VERSION 4
+
+uint64_t ir_hash(const char *data, size_t len, uint64_t seed = 14695981039346656037ULL);
+
+class ir_writer
+{
+  private:
+    std::string buf;
+  public:
+    void u(uint64_t v);
+    void s(int64_t v);
+    void str(const icu::UnicodeString &s);
+    void raw(const char *data, size_t len) { buf.append(data, len); }
+    const std::string &bytes() const { return buf; }
+};
+
+// Reads from a buffer owned by someone else. Reading past the end or an
+// overlong varint makes good() false and every later read return 0.
+class ir_reader
+{
+  private:
+    const unsigned char *p;
+    const unsigned char *end;
+    bool ok = true;
+  public:
+    ir_reader(const char *data, size_t len);
+    uint64_t u();
+    int64_t s();
+    icu::UnicodeString str();
+    bool raw(const char *expect, size_t len);
+    void fail() { ok = false; }
+    const char *pos() const { return (const char*)p; }
+    size_t remaining() const { return (size_t)(end - p); }
+    bool good() const { return ok; }
+    bool at_end() const { return p == end; }
+};
+
+#endif
@@ -4,6 +4,11 @@
 #include <unicode/ustdio.h>
 #include <libgen.h>
 #include <getopt.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <thread>
 
 using namespace std;
 
@@ -12,21 +17,52 @@ void endProgram(char *name)
   if(name != NULL)
   {
     cout << basename(name) << " v" << VERSION << ": compile lexd files to transducers" << endl;
-    cout << "USAGE: " << basename(name) << " [-abcfmtvxUV] [rule_file [output_file]]" << endl;
+    cout << "USAGE: " << basename(name) << " [-abcfjmtvxUV] [rule_file [output_file]]" << endl;
     cout << "   -a, --align:      align labels (prefer a:0 b:b to a:b b:0)" << endl;
     cout << "   -b, --bin:        output as Lttoolbox binary file (default is AT&T format)" << endl;
     cout << "   -c, --compress:   condense labels (prefer a:b to 0:b a:0 - sets --align)" << endl;
     cout << "   -f, --flags:      compile using flag diacritics" << endl;
+    cout << "   -j, --jobs=N:     parse and build on N threads, or on every core for N=auto" << endl;
     cout << "   -m, --minimize:   do hyperminimization (sets -f)" << endl;
     cout << "   -t, --tags:       compile tags and filters with flag diacritics (sets -f)" << endl;
     cout << "   -v, --verbose:    compile verbosely" << endl;
 	cout << "   -U, --no-combine: represent multi-codepoint glyphs as multiple transitions" << endl;
     cout << "   -V, --version:    print version string" << endl;
     cout << "   -x, --statistics: print lexicon and pattern sizes to stderr" << endl;
+    cout << "   --cache=DIR:      reuse lexicon and pattern transducers compiled by earlier runs" << endl;
+    cout << "   --emit-ir=FILE:   save the parsed rules to FILE" << endl;
+    cout << "   --from-ir=FILE:   load the parsed rules from FILE if it was made from rule_file" << endl;
+    cout << "   --minimizer=NAME: minimize with lttoolbox (default), lexd, or check (lexd, verified" << endl;
+    cout << "                     against lttoolbox)" << endl;
+    cout << "   --stage-states=N: minimize a pattern while building it each time it grows past" << endl;
+    cout << "                     N states (default: 1000000)" << endl;
   }
   exit(EXIT_FAILURE);
 }
 
+// The whole of arg as a positive number, or 0 if it's anything else.
+unsigned long readCount(const char *arg)
+{
+  if(arg[0] < '0' || arg[0] > '9')
+    return 0;
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(arg, &end, 10);
+  if(*end != '\0' || errno != 0)
+    return 0;
+  return n;
+}
+
+// long options without a short form
+enum
+{
+  OPT_EMIT_IR = 256,
+  OPT_FROM_IR,
+  OPT_CACHE,
+  OPT_MINIMIZER,
+  OPT_STAGE_STATES
+};
+
 int main(int argc, char *argv[])
 {
   LtLocale::tryToSetLocale();
@@ -35,7 +71,7 @@ int main(int argc, char *argv[])
   bool flags = false;
   bool single = false;
   bool stats = false;
-  UFILE* input = u_finit(stdin, NULL, NULL);
+  FILE* input = stdin;
   UFILE* output = u_finit(stdout, NULL, NULL);
   LexdCompiler comp;
 
@@ -52,6 +88,7 @@ int main(int argc, char *argv[])
       {"compress",  no_argument, 0, 'c'},
       {"flags",     no_argument, 0, 'f'},
       {"help",      no_argument, 0, 'h'},
+      {"jobs",      required_argument, 0, 'j'},
       {"minimize",  no_argument, 0, 'm'},
       {"single",    no_argument, 0, 's'},
       {"tags",      no_argument, 0, 't'},
@@ -59,12 +96,17 @@ int main(int argc, char *argv[])
 	  {"no-combine",no_argument, 0, 'U'},
       {"version",   no_argument, 0, 'V'},
       {"statistics",no_argument, 0, 'x'},
+      {"emit-ir",   required_argument, 0, OPT_EMIT_IR},
+      {"from-ir",   required_argument, 0, OPT_FROM_IR},
+      {"cache",     required_argument, 0, OPT_CACHE},
+      {"minimizer", required_argument, 0, OPT_MINIMIZER},
+      {"stage-states", required_argument, 0, OPT_STAGE_STATES},
       {0, 0, 0, 0}
     };
 
-    int cnt=getopt_long(argc, argv, "abcfhmstvUVx", long_options, &option_index);
+    int cnt=getopt_long(argc, argv, "abcfhj:mstvUVx", long_options, &option_index);
 #else
-    int cnt=getopt(argc, argv, "abcfhmstvUVx");
+    int cnt=getopt(argc, argv, "abcfhj:mstvUVx");
 #endif
     if (cnt==-1)
       break;
@@ -88,6 +130,18 @@ int main(int argc, char *argv[])
         flags = true;
         break;
 
+      case 'j':
+        if(string(optarg) == "auto")
+          comp.setJobs(max(2u, thread::hardware_concurrency()));
+        else
+        {
+          unsigned long jobs = readCount(optarg);
+          if(jobs == 0 || jobs > UINT_MAX)
+            endProgram(argv[0]);
+          comp.setJobs((unsigned int)jobs);
+        }
+        break;
+
       case 'm':
         flags = true;
         comp.setShouldHypermin(true);
@@ -119,6 +173,40 @@ int main(int argc, char *argv[])
         stats = true;
         break;
 
+#if HAVE_GETOPT_LONG
+      case OPT_EMIT_IR:
+        comp.setIROutput(optarg);
+        break;
+
+      case OPT_FROM_IR:
+        comp.setIRInput(optarg);
+        break;
+
+      case OPT_CACHE:
+        comp.setCacheDir(optarg);
+        break;
+
+      case OPT_MINIMIZER:
+        if(string(optarg) == "lttoolbox")
+          comp.setMinimizer(MinimizeLttoolbox);
+        else if(string(optarg) == "lexd")
+          comp.setMinimizer(MinimizeLexd);
+        else if(string(optarg) == "check")
+          comp.setMinimizer(MinimizeChecked);
+        else
+          endProgram(argv[0]);
+        break;
+
+      case OPT_STAGE_STATES:
+        {
+          unsigned long states = readCount(optarg);
+          if(states == 0)
+            endProgram(argv[0]);
+          comp.setStageStates((size_t)states);
+        }
+        break;
+#endif
+
       case 'h': // fallthrough
       default:
         endProgram(argv[0]);
@@ -149,7 +237,7 @@ int main(int argc, char *argv[])
 
   if(infile != "" && infile != "-")
   {
-    input = u_fopen(infile.c_str(), "rb", NULL, NULL);
+    input = fopen(infile.c_str(), "rb");
     if(!input)
     {
       cerr << "Error: Cannot open file '" << infile << "' for reading." << endl;
@@ -168,7 +256,7 @@ int main(int argc, char *argv[])
   }
 
   comp.readFile(input);
-  u_fclose(input);
+  fclose(input);
   Transducer* transducer = (single ? comp.buildTransducerSingleLexicon() : comp.buildTransducer(flags));
   if(stats)
     comp.printStatistics();
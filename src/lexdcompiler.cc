@@ -1,7 +1,16 @@
 #include "lexdcompiler.h"
+#include "minimizer.h"
 #include <unicode/unistr.h>
 #include <memory>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+#include <climits>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <lttoolbox/string_utils.h>
 
 using namespace icu;
@@ -9,23 +18,70 @@ using namespace std;
 
 bool tag_filter_t::combinable(const tag_filter_t &other) const
 {
-  // TODO: make ops combinable even with non-empty filters?
   if(empty() || other.empty())
     return true;
-  return intersectset(pos(), other.neg()).empty() && intersectset(other.pos(), neg()).empty() && ops().empty() && other.ops().empty();
+  if(pos().intersects(other.neg()) || other.pos().intersects(neg()))
+    return false;
+  if(ops().empty() && other.ops().empty())
+    return true;
+  // ops are kept as a conjunction alongside pos and neg, so the two fit
+  // as long as some choice of operands is left
+  tag_filter_t both = *this;
+  both._pos.add(other._pos);
+  both._neg.add(other._neg);
+  both._ops.insert(both._ops.end(), other._ops.begin(), other._ops.end());
+  return !both.distribute().empty();
 }
 bool tag_filter_t::combine(const tag_filter_t &other)
 {
   if(!combinable(other))
     return false;
-  unionset_inplace(_pos, other._pos);
-  unionset_inplace(_neg, other._neg);
+  _pos.add(other._pos);
+  _neg.add(other._neg);
   for(const auto &op: other._ops)
     _ops.push_back(op);
   return true;
 }
 
-void expand_alternation(vector<pattern_t> &pats, const vector<pattern_element_t> &alternation);
+vector<tag_filter_t> tag_filter_t::distribute() const
+{
+  vector<tag_filter_t> filters = { tag_filter_t(_pos, _neg) };
+  vector<tag_filter_t> next;
+  for(const auto &op : _ops)
+  {
+    next.clear();
+    for(const auto &f : filters)
+    {
+      for(string_ref tag : op.operands)
+      {
+        // |[a,b] needs a; ^[a,b] needs a and not b
+        if(f._neg.contains(tag))
+          continue;
+        if(op.kind == tag_op_t::Xor)
+        {
+          bool clash = false;
+          for(string_ref other : op.operands)
+            if(other != tag && f._pos.contains(other))
+              clash = true;
+          if(clash)
+            continue;
+        }
+        next.push_back(f);
+        tag_filter_t &nf = next.back();
+        nf._pos.insert(tag);
+        if(op.kind == tag_op_t::Xor)
+        {
+          nf._neg.add(op.operands);
+          nf._neg.erase(tag);
+        }
+      }
+    }
+    filters.swap(next);
+  }
+  return filters;
+}
+
+void add_alternation(pattern_line_t &line, const vector<pattern_element_t> &alternation);
 vector<pattern_element_t> distribute_tag_expressions(const pattern_element_t &token)
 {
   vector<pattern_element_t> result;
@@ -40,27 +96,39 @@ vector<pattern_element_t> distribute_tag_expressions(const pattern_element_t &to
 
 bool tag_filter_t::compatible(const tags_t &tags) const
 {
-  return subset(pos(), tags) && intersectset(neg(), tags).empty() && ops().empty();
+  if(!pos().subset_of(tags) || neg().intersects(tags))
+    return false;
+  for(const auto &op : ops())
+  {
+    // |[a,b] needs at least one operand, ^[a,b] exactly one
+    unsigned int present = 0;
+    for(string_ref tag : op.operands)
+      if(tags.contains(tag))
+        present++;
+    if(present == 0 || (op.kind == tag_op_t::Xor && present > 1))
+      return false;
+  }
+  return true;
 }
 bool tag_filter_t::applicable(const tags_t &tags) const
 {
-  return subset(neg(), tags) && ops().empty();
+  return neg().subset_of(tags) && ops().empty();
 }
 bool tag_filter_t::try_apply(tags_t &tags) const
 {
   if(!applicable(tags))
     return false;
-  subtractset_inplace(tags, neg());
-  unionset_inplace(tags, pos());
+  tags.remove(neg());
+  tags.add(pos());
   return true;
 }
 bool pattern_element_t::compatible(const lex_seg_t &tok) const
 {
   return left.name.empty() || right.name.empty() || tag_filter.compatible(tok.tags);
 }
-const UnicodeString &LexdCompiler::name(string_ref r) const
+UnicodeString LexdCompiler::name(string_ref r) const
 {
-  return id_to_name[(unsigned int)r];
+  return names.name((unsigned int)r);
 }
 
 UnicodeString LexdCompiler::printPattern(const pattern_element_t& pat)
@@ -109,10 +177,10 @@ UnicodeString LexdCompiler::printFilter(const tag_filter_t& filter)
   }
   for (auto& op : filter.ops()) {
     if (ret.length() > 1) ret += ',';
-    ret += op->sigil;
+    ret += op.sigil();
     ret += '[';
     int ln = ret.length();
-    for (auto& it : *op) {
+    for (auto& it : op.operands) {
       if (ret.length() > ln) ret += ',';
       ret += name(it);
     }
@@ -127,22 +195,39 @@ trans_sym_t LexdCompiler::alphabet_lookup(const UnicodeString &symbol)
   if (!symbol.hasMoreChar32Than(0, symbol.length(), 1)) {
     return trans_sym_t((int)symbol.char32At(0));
   } else {
-    UString temp;
-    temp.append(symbol.getBuffer(), (unsigned int)symbol.length());
-    alphabet.includeSymbol(temp);
-    return trans_sym_t(alphabet(temp));
+    // symbols are registered with the alphabet the first time they
+    // are seen, so ids come out in the same order as before
+    unsigned int idx = symbolNames.intern(symbol);
+    if (idx == symbolIds.size()) {
+      UString temp;
+      temp.append(symbol.getBuffer(), (unsigned int)symbol.length());
+      alphabet.includeSymbol(temp);
+      symbolIds.push_back(trans_sym_t(alphabet(temp)));
+    }
+    for(cache_log_t* log : cacheLogs)
+      if(log->seen_symbols.insert((int)symbolIds[idx]).second)
+        log->symbols.push_back(symbolIds[idx]);
+    return symbolIds[idx];
   }
 }
 trans_sym_t LexdCompiler::alphabet_lookup(trans_sym_t l, trans_sym_t r)
 {
-  return trans_sym_t(alphabet((int)l, (int)r));
+  const uint64_t key = ((uint64_t)(uint32_t)(int)l << 32) | (uint32_t)(int)r;
+  for(cache_log_t* log : cacheLogs)
+    if(log->seen_pairs.insert(key).second)
+      log->pairs.push_back(make_pair(l, r));
+  auto it = pairIds.find(key);
+  if (it != pairIds.end())
+    return it->second;
+  trans_sym_t id = trans_sym_t(alphabet((int)l, (int)r));
+  pairIds.emplace(key, id);
+  return id;
 }
 
 LexdCompiler::LexdCompiler()
 {
-  id_to_name.push_back("");
-  name_to_id[""] = string_ref(0);
-  lexicons[string_ref(0)] = vector<entry_t>();
+  internName("");
+  lexicons[string_ref(0)] = lexicon_t();
 
   left_sieve_name = internName("<");
   token_t lsieve_tok = {.name=left_sieve_name, .part=1, .optional=false};
@@ -167,9 +252,14 @@ LexdCompiler::~LexdCompiler()
 // and make it a macro so we don't have issues with it deallocating
 #define err(s) (to_ustring(s).c_str())
 
+// thrown by die() in worker compilers, see parseChunk()
+struct worker_abort {};
+
 void
 LexdCompiler::die(const char* msg, ...)
 {
+  if(worker)
+    throw worker_abort();
   UFILE* err_out = u_finit(stderr, NULL, NULL);
   u_fprintf(err_out, "Error on line %d: ", lineNumber);
   va_list argptr;
@@ -182,10 +272,14 @@ LexdCompiler::die(const char* msg, ...)
 
 void LexdCompiler::appendLexicon(string_ref lexicon_id, const vector<entry_t> &to_append)
 {
-  if(lexicons.find(lexicon_id) == lexicons.end())
-    lexicons[lexicon_id] = to_append;
-  else
-    lexicons[lexicon_id].insert(lexicons[lexicon_id].begin(), to_append.begin(), to_append.end());
+  lexicon_t lex;
+  for(const entry_t &entry : to_append)
+    lex.add(entry);
+  auto it = lexicons.find(lexicon_id);
+  if(it == lexicons.end())
+    lexicons[lexicon_id] = std::move(lex);
+  else // later definitions of a lexicon go in front of the earlier ones
+    it->second.prepend(lex);
 }
 
 void
@@ -207,12 +301,7 @@ LexdCompiler::finishLexicon()
 string_ref
 LexdCompiler::internName(const UnicodeString& name)
 {
-  if(name_to_id.find(name) == name_to_id.end())
-  {
-    name_to_id[name] = string_ref(id_to_name.size());
-    id_to_name.push_back(name);
-  }
-  return name_to_id[name];
+  return string_ref(names.intern(name));
 }
 
 string_ref
@@ -232,27 +321,27 @@ LexdCompiler::checkName(UnicodeString& name)
 }
 
 tags_t
-LexdCompiler::readTags(char_iter &iter, UnicodeString &line)
+LexdCompiler::readTags(token_iter &iter, UnicodeString &line)
 {
   tag_filter_t filter = readTagFilter(iter, line);
   if(filter.neg().empty() && filter.ops().empty())
-    return tags_t((set<string_ref>)filter.pos());
+    return tags_t(filter.pos());
   else
      die("Cannot declare negative tag in lexicon");
   return tags_t();
 }
 
 tag_filter_t
-LexdCompiler::readTagFilter(char_iter& iter, UnicodeString& line)
+LexdCompiler::readTagFilter(token_iter& iter, UnicodeString& line)
 {
   tag_filter_t tag_filter;
   auto tag_start = (++iter).span();
   bool tag_nonempty = false;
   bool negative = false;
-  vector<shared_ptr<op_tag_filter_t>> ops;
-  for(; !iter.at_end() && (*iter).length() > 0; ++iter)
+  vector<tag_op_t> ops;
+  for(; !iter.at_end(); ++iter)
   {
-    if(*iter == "]" || *iter == "," || *iter == " ")
+    if(iter.in(CC_RBRACKET | CC_COMMA | CC_SPACE))
     {
       if(!tag_nonempty)
         die("Empty tag at char %d", + iter.span().first);
@@ -264,35 +353,32 @@ LexdCompiler::readTagFilter(char_iter& iter, UnicodeString& line)
         die("Illegal tag filter.");
       tag_nonempty = false;
       negative = false;
-      if(*iter == "]")
+      if(iter.is(']'))
       {
         iter++;
         return tag_filter_t(tag_filter.pos(), tag_filter.neg(), ops);
       }
     }
-    else if(!tag_nonempty && *iter == "-")
+    else if(!tag_nonempty && iter.is('-'))
     {
       negative = true;
     }
-    else if(!tag_nonempty && (*iter == "|" || *iter == "^"))
+    else if(!tag_nonempty && (iter.is('|') || iter.is('^')))
     {
-      const UnicodeString s = *iter;
+      const UChar op_char = iter.lead();
       if(negative)
         die("Illegal negated operation.");
-      *iter++;
-      if (*iter == "[")
+      iter++;
+      if (iter.is('['))
       {
-        shared_ptr<op_tag_filter_t> op;
-        tags_t operands = readTags(iter, line);
-        if (s == "|")
-          op = make_shared<or_tag_filter_t>(operands);
-        else if (s == "^")
-          op = make_shared<xor_tag_filter_t>(operands);
+        tag_op_t op;
+        op.kind = (op_char == '^' ? tag_op_t::Xor : tag_op_t::Or);
+        op.operands = readTags(iter, line);
         ops.push_back(op);
       }
       else
         die("Expected list of operands.");
-      if(*iter == "]")
+      if(iter.is(']'))
       {
         iter++;
         return tag_filter_t(tag_filter.pos(), tag_filter.neg(), ops);
@@ -321,22 +407,22 @@ LexdCompiler::appendSymbol(const UnicodeString& s, lex_token_t& tok)
 }
 
 void
-LexdCompiler::readSymbol(char_iter& iter, UnicodeString& line, lex_token_t& tok)
+LexdCompiler::readSymbol(token_iter& iter, UnicodeString& line, lex_token_t& tok)
 {
-  if ((*iter).startsWith("\\")) {
-    if ((*iter).length() == 1) {
+  if (iter.starts('\\')) {
+    if (iter.length() == 1) {
       appendSymbol(*++iter, tok);
     } else {
       appendSymbol((*iter).tempSubString(1), tok);
     }
-  } else if ((*iter).startsWith(":")) {
+  } else if (iter.starts(':')) {
     appendSymbol((*iter).tempSubString(1), tok);
-  } else if (*iter == "{" || *iter == "<") {
-    UChar end = (*iter == "{") ? '}' : '>';
+  } else if (iter.in(CC_MULTICHAR)) {
+    UChar end = iter.is('{') ? '}' : '>';
     int i = iter.span().first;
-    for (; !iter.at_end() && *iter != end; ++iter) ;
+    for (; !iter.at_end() && !iter.is(end); ++iter) ;
 
-    if (*iter == end) {
+    if (iter.is(end)) {
       tok.symbols.push_back(alphabet_lookup(line.tempSubStringBetween(i, iter.span().second)));
     } else {
       die("Multichar symbol didn't end; searching for %S", err(end));
@@ -346,106 +432,212 @@ LexdCompiler::readSymbol(char_iter& iter, UnicodeString& line, lex_token_t& tok)
   }
 }
 
-int
-LexdCompiler::processRegexTokenSeq(char_iter& iter, UnicodeString& line, Transducer* trans, int start_state)
+void
+LexdCompiler::parseRegexRun(token_iter& iter, UnicodeString& line, regex_t& run)
 {
   bool inleft = true;
-  vector<vector<lex_token_t>> left, right;
   for (; !iter.at_end(); ++iter) {
-    if (*iter == "(" || *iter == ")" || *iter == "|" || *iter == "/") break;
-    else if (*iter == "?" || *iter == "*" || *iter == "+")
+    if (iter.in(CC_REGEX_BOUNDARY)) break;
+    else if (iter.in(CC_MODIFIER))
       die("Quantifier %S may only be applied to parenthesized groups", err(*iter));
-    else if (*iter == "]") die("Regex contains mismatched ]");
-    else if (*iter == ":" && inleft) inleft = false;
-    else if (*iter == ":") die("Regex contains multiple colons");
-    else if (*iter == "[") {
+    else if (iter.is(']')) die("Regex contains mismatched ]");
+    else if (iter.is(':') && inleft) inleft = false;
+    else if (iter.is(':')) die("Regex contains multiple colons");
+    else if (iter.is('[')) {
       ++iter;
-      vector<lex_token_t> sym;
+      regex_class_t cls;
       for (; !iter.at_end(); ++iter) {
-        if (*iter == "]") break;
-        else if (*iter == "-" && !sym.empty()) {
+        if (iter.is(']')) break;
+        else if (iter.is('-') && !cls.items.empty()) {
           ++iter;
-          if (*iter == "]" || iter.at_end()) {
+          if (iter.is(']') || iter.at_end()) {
             --iter;
             lex_token_t temp;
             readSymbol(iter, line, temp);
-            sym.push_back(temp);
+            cls.items.emplace_back();
+            cls.items.back().symbols = temp.symbols;
           } else {
-            lex_token_t start = sym.back();
+            auto& start = cls.items.back();
             lex_token_t end;
             readSymbol(iter, line, end);
             // This will fail on diacritics even with -U
             // on the principle that command-line args should not
             // change the validity of the code -DGS 2022-05-17
-            if (start.symbols.size() != 1 || end.symbols.size() != 1 ||
-                (int)start.symbols[0] <= 0 || (int)end.symbols[0] <= 0)
+            if ((!start.range && (start.symbols.size() != 1 || (int)start.symbols[0] <= 0)) ||
+                end.symbols.size() != 1 || (int)end.symbols[0] <= 0)
               die("Cannot process symbol range between multichar symbols");
-            int i_start = (int)start.symbols[0];
+            int i_start = (start.range ? start.last : (int)start.symbols[0]);
             int i_end = (int)end.symbols[0];
             if (i_start > i_end)
               die("First character in symbol range does not preceed last");
-            for (int i = 1 + i_start; i <= i_end; i++) {
-              lex_token_t mid;
-              mid.symbols.push_back((trans_sym_t)i);
-              sym.push_back(mid);
+            if (i_start < i_end) {
+              regex_class_t::item_t range;
+              range.range = true;
+              range.first = i_start + 1;
+              range.last = i_end;
+              cls.items.push_back(range);
             }
           }
         } else {
           lex_token_t temp;
           readSymbol(iter, line, temp);
-          sym.push_back(temp);
+          cls.items.emplace_back();
+          cls.items.back().symbols = temp.symbols;
         }
       }
-      (inleft ? left : right).push_back(sym);
+      (inleft ? run.left : run.right).push_back(internRegexClass(cls));
     } else {
-      vector<lex_token_t> v_temp;
+      regex_class_t cls;
       lex_token_t t_temp;
       readSymbol(iter, line, t_temp);
-      v_temp.push_back(t_temp);
-      (inleft ? left : right).push_back(v_temp);
+      cls.items.emplace_back();
+      cls.items.back().symbols = t_temp.symbols;
+      (inleft ? run.left : run.right).push_back(internRegexClass(cls));
+    }
+  }
+  run.identity = inleft;
+}
+
+void
+LexdCompiler::parseRegexGroup(token_iter& iter, UnicodeString& line, regex_t& group, unsigned int depth)
+{
+  ++iter; // initial slash or paren
+  group.options.emplace_back();
+  for (; !iter.at_end(); ++iter) {
+    if (iter.is('(')) {
+      group.options.back().emplace_back();
+      parseRegexGroup(iter, line, group.options.back().back(), depth+1);
+      --iter;
+      // this function ends on character after close paren or quantifier
+      // so step back so loop increment doesn't skip a character
+    }
+    else if (iter.is(')') || iter.is('/')) break;
+    else if (iter.is('|'))
+      group.options.emplace_back();
+    else {
+      group.options.back().emplace_back();
+      parseRegexRun(iter, line, group.options.back().back());
+      --iter;
+    }
+  }
+  if ((depth > 0 && iter.is('/')) || (depth == 0 && iter.is(')')))
+    die("Mismatched parentheses in regex");
+  if (iter.at_end())
+    die("Unterminated regex");
+  ++iter;
+  if (depth > 0 && (iter.is('?') || iter.is('*') || iter.is('+'))) {
+    group.quantifier = (*iter)[0];
+    ++iter;
+  }
+}
+
+// Calls f(symbols, length) for each alternative of a regex class, in
+// the order they were written. An empty class has the one alternative,
+// epsilon.
+template<typename F>
+static void
+forEachAlternative(const regex_class_t& cls, F f)
+{
+  if (cls.items.empty()) {
+    trans_sym_t eps;
+    f(&eps, 1);
+    return;
+  }
+  for (auto& item : cls.items) {
+    if (item.range) {
+      for (int c = item.first; c <= item.last; c++) {
+        trans_sym_t sym = (trans_sym_t)c;
+        f(&sym, 1);
+      }
+    } else {
+      f(item.symbols.data(), (unsigned int)item.symbols.size());
+    }
+  }
+}
+
+unsigned int
+LexdCompiler::internRegexClass(regex_class_t& cls)
+{
+  string key;
+  auto num = [&key](int n) { key.append((const char*)&n, sizeof(int)); };
+  for (auto& item : cls.items) {
+    if (item.range) {
+      key += 'r';
+      num(item.first);
+      num(item.last);
+    } else {
+      key += 's';
+      num((int)item.symbols.size());
+      for (auto& sym : item.symbols)
+        num((int)sym);
     }
   }
+  auto it = regexClassIds.emplace(key, (unsigned int)regexClasses.size());
+  if (it.second)
+    regexClasses.push_back(std::move(cls));
+  return it.first->second;
+}
+
+// The class with the identity pairs of its alternatives looked up, if
+// they haven't been already.
+const regex_class_t&
+LexdCompiler::expandRegexClass(unsigned int id)
+{
+  regex_class_t& cls = regexClasses[id];
+  if (!cls.expanded) {
+    forEachAlternative(cls, [&](const trans_sym_t* syms, unsigned int len) {
+      for (unsigned int k = 0; k < len; k++)
+        cls.pairs.push_back((int)alphabet_lookup(syms[k], syms[k]));
+      cls.ends.push_back((unsigned int)cls.pairs.size());
+    });
+    cls.expanded = true;
+  }
+  return cls;
+}
+
+int
+LexdCompiler::buildRegexRun(const regex_t& run, Transducer* trans, int start_state)
+{
   int state = start_state;
-  vector<lex_token_t> empty_vec;
-  lex_token_t empty_tok;
-  empty_tok.symbols.push_back(trans_sym_t());
-  empty_vec.push_back(empty_tok);
-  for (unsigned int i = 0; i < left.size() || i < right.size(); i++) {
-    vector<lex_token_t>& lv = (i < left.size() && !left[i].empty() ?
-                               left[i] : empty_vec);
-    vector<lex_token_t>& rv = (i < right.size() && !right[i].empty() ?
-                               right[i] : empty_vec);
-    bool first = true;
+  for (unsigned int i = 0; i < run.left.size() || i < run.right.size(); i++) {
     int dest_state = 0;
-    if (inleft) {
-      for (auto& s : lv) {
-        if (first) {
+    if (run.identity) {
+      // with no colon there's only the left side
+      const regex_class_t& lv = expandRegexClass(run.left[i]);
+      unsigned int begin = 0;
+      for (unsigned int k = 0; k < lv.ends.size(); begin = lv.ends[k++]) {
+        const unsigned int end = lv.ends[k];
+        if (k == 0) {
           dest_state = state;
-          for (auto& it : s.symbols)
-            dest_state = trans->insertNewSingleTransduction(alphabet((int)it, (int)it), dest_state);
+          for (unsigned int j = begin; j < end; j++)
+            dest_state = trans->insertNewSingleTransduction(lv.pairs[j], dest_state);
           if (dest_state == state)
             dest_state = trans->insertNewSingleTransduction(0, dest_state);
-          first = false;
-        } else if (s.symbols.empty()) {
+        } else if (begin == end) {
           trans->linkStates(state, dest_state, 0);
         } else {
           int cur_state = state;
-          for (unsigned int k = 0; k < s.symbols.size(); k++) {
-            if (k+1 == s.symbols.size())
-              trans->linkStates(cur_state, dest_state, alphabet((int)s.symbols[k], (int)s.symbols[k]));
+          for (unsigned int j = begin; j < end; j++) {
+            if (j+1 == end)
+              trans->linkStates(cur_state, dest_state, lv.pairs[j]);
             else
-              cur_state = trans->insertNewSingleTransduction(alphabet((int)s.symbols[k], (int)s.symbols[k]), cur_state);
+              cur_state = trans->insertNewSingleTransduction(lv.pairs[j], cur_state);
           }
         }
       }
     } else {
-      for (auto& l : lv) {
-        for (auto& r : rv) {
-          vector<int> paired;
-          for (unsigned int j = 0; j < l.symbols.size() || j < r.symbols.size(); j++) {
-            trans_sym_t ls = (j < l.symbols.size() ? l.symbols[j] : trans_sym_t());
-            trans_sym_t rs = (j < r.symbols.size() ? r.symbols[j] : trans_sym_t());
-            paired.push_back(alphabet((int)ls, (int)rs));
+      static const regex_class_t empty_class;
+      const regex_class_t& lv = (i < run.left.size() ? regexClasses[run.left[i]] : empty_class);
+      const regex_class_t& rv = (i < run.right.size() ? regexClasses[run.right[i]] : empty_class);
+      bool first = true;
+      vector<int> paired;
+      forEachAlternative(lv, [&](const trans_sym_t* l, unsigned int l_len) {
+        forEachAlternative(rv, [&](const trans_sym_t* r, unsigned int r_len) {
+          paired.clear();
+          for (unsigned int j = 0; j < l_len || j < r_len; j++) {
+            trans_sym_t ls = (j < l_len ? l[j] : trans_sym_t());
+            trans_sym_t rs = (j < r_len ? r[j] : trans_sym_t());
+            paired.push_back((int)alphabet_lookup(ls, rs));
           }
           if (first) {
             dest_state = state;
@@ -462,8 +654,8 @@ LexdCompiler::processRegexTokenSeq(char_iter& iter, UnicodeString& line, Transdu
                 cur_state = trans->insertNewSingleTransduction(paired[k], cur_state);
             }
           }
-        }
-      }
+        });
+      });
     }
     state = dest_state;
   }
@@ -471,66 +663,113 @@ LexdCompiler::processRegexTokenSeq(char_iter& iter, UnicodeString& line, Transdu
 }
 
 int
-LexdCompiler::processRegexGroup(char_iter& iter, UnicodeString& line, Transducer* trans, int start_state, unsigned int depth)
+LexdCompiler::buildRegexGroup(const regex_t& group, Transducer* trans, int start_state)
 {
-  ++iter; // initial slash or paren
   int state = start_state;
   vector<int> option_ends;
-  for (; !iter.at_end(); ++iter) {
-    if (*iter == "(") {
-      state = trans->insertNewSingleTransduction(0, state);
-      state = processRegexGroup(iter, line, trans, state, depth+1);
-      --iter;
-      // this function ends on character after close paren or quantifier
-      // so step back so loop increment doesn't skip a character
-    }
-    else if (*iter == ")" || *iter == "/") break;
-    else if (*iter == "|") {
+  for (unsigned int o = 0; o < group.options.size(); o++) {
+    if (o > 0) {
       if (state == start_state)
         state = trans->insertNewSingleTransduction(0, state);
       option_ends.push_back(state);
       state = start_state;
     }
-    else {
-      state = processRegexTokenSeq(iter, line, trans, state);
-      --iter;
+    for (auto& node : group.options[o]) {
+      if (node.options.empty())
+        state = buildRegexRun(node, trans, state);
+      else {
+        state = trans->insertNewSingleTransduction(0, state);
+        state = buildRegexGroup(node, trans, state);
+      }
     }
   }
   if (state == start_state)
     state = trans->insertNewSingleTransduction(0, state);
   for (auto& it : option_ends)
     trans->linkStates(it, state, 0);
-  if ((depth > 0 && *iter == "/") || (depth == 0 && *iter == ")"))
-    die("Mismatched parentheses in regex");
-  if (iter.at_end())
-    die("Unterminated regex");
-  ++iter;
-  if (depth > 0) {
-    if (*iter == "?") {
-      trans->linkStates(start_state, state, 0);
-      ++iter;
-    } else if (*iter == "*") {
-      trans->linkStates(start_state, state, 0);
-      trans->linkStates(state, start_state, 0);
-      ++iter;
-    } else if (*iter == "+") {
-      trans->linkStates(state, start_state, 0);
-      ++iter;
-    }
+  if (group.quantifier == '?') {
+    trans->linkStates(start_state, state, 0);
+  } else if (group.quantifier == '*') {
+    trans->linkStates(start_state, state, 0);
+    trans->linkStates(state, start_state, 0);
+  } else if (group.quantifier == '+') {
+    trans->linkStates(state, start_state, 0);
   }
   return state;
 }
 
+// Writes out a parsed regex so that two regexes get the same key
+// exactly when they'd compile to the same transducer.
+static void
+regexKey(const regex_t& re, string& key)
+{
+  auto num = [&key](int n) { key.append((const char*)&n, sizeof(int)); };
+  if (re.options.empty()) {
+    key += (re.identity ? 'i' : 'p');
+    for (auto side : {&re.left, &re.right}) {
+      num((int)side->size());
+      for (unsigned int cls : *side)
+        num((int)cls);
+    }
+  } else {
+    key += '(';
+    num((int)re.options.size());
+    for (auto& option : re.options) {
+      num((int)option.size());
+      for (auto& node : option)
+        regexKey(node, key);
+    }
+    key += (char)re.quantifier;
+  }
+}
+
+// Reads the regex starting at the slash under iter and returns its
+// transducer. Each distinct regex is built once, minimized with whichever
+// minimizer was chosen, and kept for the lifetime of the compiler.
+Transducer*
+LexdCompiler::processRegex(token_iter& iter, UnicodeString& line)
+{
+  regex_t re;
+  parseRegexGroup(iter, line, re, 0);
+  string key;
+  regexKey(re, key);
+  auto found = regexCache.find(key);
+  if (found != regexCache.end())
+    return found->second;
+  Transducer* trans = new Transducer();
+  trans->setFinal(buildRegexGroup(re, trans, trans->getInitial()));
+  minimizeTransducer(trans);
+  // Minimizing leaves no epsilons, but this puts some back: the regex
+  // is shared, and insertTransducer() joins the finals of what it
+  // inserts, so that has to be done once here or threads building
+  // lexicons would all write to it. Splicing a regex in at several final
+  // states would need the rest of the entry copied after each of them.
+  if (trans->getFinals().size() > 1) {
+    vector<int> finals;
+    for (auto& fin : trans->getFinals())
+      finals.push_back(fin.first);
+    int end = trans->newState();
+    for (int fin : finals) {
+      trans->linkStates(fin, end, 0);
+      trans->setFinal(fin, 0, false);
+    }
+    trans->setFinal(end);
+  }
+  regexStore.emplace_back(trans);
+  regexCache[key] = trans;
+  return trans;
+}
+
 lex_seg_t
-LexdCompiler::processLexiconSegment(char_iter& iter, UnicodeString& line, unsigned int part_count)
+LexdCompiler::processLexiconSegment(token_iter& iter, UnicodeString& line, unsigned int part_count)
 {
   lex_seg_t seg;
   bool inleft = true;
   bool left_tags_applied = false, right_tags_applied = false;
   tag_filter_t tags;
-  if((*iter).startsWith(" "))
+  if(iter.starts(' '))
   {
-    if((*iter).length() > 1)
+    if(iter.length() > 1)
     {
       // if it's a space with a combining diacritic after it,
       // then we want the diacritic
@@ -540,19 +779,17 @@ LexdCompiler::processLexiconSegment(char_iter& iter, UnicodeString& line, unsign
     }
     ++iter;
   }
-  if((*iter).startsWith("/") && seg.left.symbols.size() == 0)
+  if(iter.starts('/') && seg.left.symbols.size() == 0)
   {
-    seg.regex = new Transducer();
-    int state = processRegexGroup(iter, line, seg.regex, 0, 0);
-    seg.regex->setFinal(state);
+    seg.regex = processRegex(iter, line);
   }
   if(iter.at_end() && seg.regex == nullptr && seg.left.symbols.size() == 0)
     die("Expected %d parts, found %d", currentLexiconPartCount, part_count);
   for(; !iter.at_end(); ++iter)
   {
-    if((*iter).startsWith(" ") || *iter == ']')
+    if(iter.starts(' ') || iter.is(']'))
       break;
-    else if(*iter == "[")
+    else if(iter.is('['))
     {
       auto &tags_applied = inleft ? left_tags_applied : right_tags_applied;
       if(tags_applied)
@@ -561,13 +798,13 @@ LexdCompiler::processLexiconSegment(char_iter& iter, UnicodeString& line, unsign
       --iter;
       tags_applied = true;
     }
-    else if((*iter).startsWith(":"))
+    else if(iter.starts(':'))
     {
       if(inleft)
         inleft = false;
       else
         die("Lexicon entry contains multiple colons");
-      if ((*iter).length() > 1) readSymbol(iter, line, seg.right);
+      if (iter.length() > 1) readSymbol(iter, line, seg.right);
     }
     else readSymbol(iter, line, (inleft ? seg.left : seg.right));
   }
@@ -584,7 +821,10 @@ LexdCompiler::processLexiconSegment(char_iter& iter, UnicodeString& line, unsign
 
   if(!tags.try_apply(seg.tags))
   {
-    tags_t diff = subtractset(tags.neg(), seg.tags);
+    if(worker)
+      throw worker_abort();
+    tags_t diff = tags.neg();
+    diff.remove(seg.tags);
     for(string_ref t: diff)
       cerr << "Bad tag '-" << to_ustring(name(t)) << "'" << endl;
     die("Negative tag has no default to unset.");
@@ -594,13 +834,11 @@ LexdCompiler::processLexiconSegment(char_iter& iter, UnicodeString& line, unsign
 }
 
 token_t
-LexdCompiler::readToken(char_iter& iter, UnicodeString& line)
+LexdCompiler::readToken(token_iter& iter, UnicodeString& line)
 {
   auto begin_charspan = iter.span();
 
-  const UnicodeString boundary = " :()[]+*?|<>";
-
-  for(; !iter.at_end() && boundary.indexOf(*iter) == -1; ++iter);
+  for(; !iter.at_end() && !iter.in(CC_NAME_BOUNDARY); ++iter);
   UnicodeString name;
   line.extract(begin_charspan.first, (iter.at_end() ? line.length() : iter.span().first) - begin_charspan.first, name);
 
@@ -608,9 +846,9 @@ LexdCompiler::readToken(char_iter& iter, UnicodeString& line)
     die("Symbol '%S' without lexicon name at u16 %d-%d", err(*iter), iter.span().first, iter.span().second-1);
 
   bool optional = false;
-  if(*iter == "?") {
+  if(iter.is('?')) {
     iter++;
-    if(*iter == "(") {
+    if(iter.is('(')) {
       optional = true;
     } else {
       iter--;
@@ -618,16 +856,16 @@ LexdCompiler::readToken(char_iter& iter, UnicodeString& line)
   }
 
   unsigned int part = 1;
-  if(*iter == "(")
+  if(iter.is('('))
   {
     iter++;
     begin_charspan = iter.span();
-    for(; !iter.at_end() && (*iter).length() > 0 && *iter != ")"; iter++)
+    for(; !iter.at_end() && !iter.is(')'); iter++)
     {
-      if((*iter).length() != 1 || !u_isdigit((*iter).charAt(0)))
+      if(iter.length() != 1 || !u_isdigit(iter.lead()))
         die("Syntax error - non-numeric index in parentheses: %S", err(*iter));
     }
-    if(*iter != ")")
+    if(!iter.is(')'))
       die("Syntax error - unmatched parenthesis");
     if(iter.span().first == begin_charspan.first)
       die("Syntax error - missing index in parenthesis");
@@ -640,19 +878,19 @@ LexdCompiler::readToken(char_iter& iter, UnicodeString& line)
 }
 
 RepeatMode
-LexdCompiler::readModifier(char_iter& iter)
+LexdCompiler::readModifier(token_iter& iter)
 {
-  if(*iter == "?")
+  if(iter.is('?'))
   {
     ++iter;
     return Question;
   }
-  else if(*iter == "*")
+  else if(iter.is('*'))
   {
     ++iter;
     return Star;
   }
-  else if(*iter == "+")
+  else if(iter.is('+'))
   {
     ++iter;
     return Plus;
@@ -661,42 +899,38 @@ LexdCompiler::readModifier(char_iter& iter)
 }
 
 pattern_element_t
-LexdCompiler::readPatternElement(char_iter& iter, UnicodeString& line)
+LexdCompiler::readPatternElement(token_iter& iter, UnicodeString& line)
 {
-  const UnicodeString boundary = " :()[]+*?|<>";
   pattern_element_t tok;
-  if(*iter == ":")
+  if(iter.is(':'))
   {
     iter++;
-    if(boundary.indexOf(*iter) != -1)
+    if(iter.at_end() || iter.in(CC_NAME_BOUNDARY))
     {
-      if(*iter == ":")
+      if(iter.is(':'))
         die("Syntax error - double colon");
       else
         die("Colon without lexicon or pattern name");
     }
     tok.right = readToken(iter, line);
   }
-  else if(boundary.indexOf(*iter) != -1)
+  else if(iter.in(CC_NAME_BOUNDARY))
   {
     die("Unexpected symbol '%S' at column %d", err(*iter), iter.span().first);
   }
   else
   {
     tok.left = readToken(iter, line);
-    if(*iter == "[")
+    if(iter.is('['))
     {
       tok.tag_filter.combine(readTagFilter(iter, line));
     }
-    if(*iter == ":")
+    if(iter.is(':'))
     {
       iter++;
-      if(!iter.at_end() && (*iter).length() > 0)
+      if(!iter.at_end() && !iter.in(CC_NAME_BOUNDARY))
       {
-        if(boundary.indexOf(*iter) == -1)
-        {
-          tok.right = readToken(iter, line);
-        }
+        tok.right = readToken(iter, line);
       }
     }
     else
@@ -704,7 +938,7 @@ LexdCompiler::readPatternElement(char_iter& iter, UnicodeString& line)
       tok.right = tok.left;
     }
   }
-  if(*iter == "[")
+  if(iter.is('['))
   {
     tok.tag_filter.combine(readTagFilter(iter, line));
   }
@@ -714,24 +948,18 @@ LexdCompiler::readPatternElement(char_iter& iter, UnicodeString& line)
 }
 
 void
-LexdCompiler::processPattern(char_iter& iter, UnicodeString& line)
+LexdCompiler::processPattern(token_iter& iter, UnicodeString& line)
 {
-  vector<pattern_t> pats_cur(1);
+  pattern_line_t line_cur;
   vector<pattern_element_t> alternation;
   bool final_alternative = true;
   bool sieve_forward = false;
   bool just_sieved = false;
-  const UnicodeString boundary = " :()[]+*?|<>";
-  const UnicodeString token_boundary = " )|<>";
-  const UnicodeString token_side_boundary = token_boundary + ":+*?";
-  const UnicodeString token_side_name_boundary = token_side_boundary + "([]";
-  const UnicodeString modifier = "+*?";
-  const UnicodeString decrement_after_token = token_boundary + "([]";
 
-  for(; !iter.at_end() && *iter != ')' && (*iter).length() > 0; ++iter)
+  for(; !iter.at_end() && !iter.is(')'); ++iter)
   {
-    if(*iter == " ") ;
-    else if(*iter == "|")
+    if(iter.is(' ')) ;
+    else if(iter.is('|'))
     {
       if(alternation.empty())
         die("Syntax error - initial |");
@@ -741,7 +969,7 @@ LexdCompiler::processPattern(char_iter& iter, UnicodeString& line)
         die("Syntax error - sieve and alternation operators without intervening token");
       final_alternative = false;
     }
-    else if(*iter == "<")
+    else if(iter.is('<'))
     {
       if(sieve_forward)
         die("Syntax error - cannot sieve backwards after forwards.");
@@ -751,12 +979,12 @@ LexdCompiler::processPattern(char_iter& iter, UnicodeString& line)
         die("Syntax error - multiple consecutive sieve operators");
       if(!final_alternative)
         die("Syntax error - alternation and sieve operators without intervening token");
-      expand_alternation(pats_cur, alternation);
-      expand_alternation(pats_cur, left_sieve_tok);
+      add_alternation(line_cur, alternation);
+      add_alternation(line_cur, left_sieve_tok);
       alternation.clear();
       just_sieved = true;
     }
-    else if(*iter == ">")
+    else if(iter.is('>'))
     {
       sieve_forward = true;
       if(alternation.empty())
@@ -765,12 +993,12 @@ LexdCompiler::processPattern(char_iter& iter, UnicodeString& line)
         die("Syntax error - multiple consecutive sieve operators");
       if(!final_alternative)
         die("Syntax error - alternation and sieve operators without intervening token");
-      expand_alternation(pats_cur, alternation);
-      expand_alternation(pats_cur, right_sieve_tok);
+      add_alternation(line_cur, alternation);
+      add_alternation(line_cur, right_sieve_tok);
       alternation.clear();
       just_sieved = true;
     }
-    else if(*iter == "[")
+    else if(iter.is('['))
     {
       UnicodeString name = UnicodeString::fromUTF8(" " + to_string(anonymousCount++));
       currentLexiconId = internName(name);
@@ -778,14 +1006,14 @@ LexdCompiler::processPattern(char_iter& iter, UnicodeString& line)
       inLex = true;
       entry_t entry;
       entry.push_back(processLexiconSegment(++iter, line, 0));
-      if(*iter == " ") iter++;
-      if(*iter != "]")
+      if(iter.is(' ')) iter++;
+      if(!iter.is(']'))
         die("Missing closing ] for anonymous lexicon");
       currentLexicon.push_back(entry);
       finishLexicon();
       if(final_alternative && !alternation.empty())
       {
-        expand_alternation(pats_cur, alternation);
+        add_alternation(line_cur, alternation);
         alternation.clear();
       }
       ++iter;
@@ -798,24 +1026,24 @@ LexdCompiler::processPattern(char_iter& iter, UnicodeString& line)
       final_alternative = true;
       just_sieved = false;
     }
-    else if(*iter == "(")
+    else if(iter.is('('))
     {
       string_ref temp = currentPatternId;
       UnicodeString name = UnicodeString::fromUTF8(" " + to_string(anonymousCount++));
       currentPatternId = internName(name);
       ++iter;
       processPattern(iter, line);
-      if(*iter == " ")
-        *iter++;
-      if(iter.at_end() || *iter != ")")
+      if(iter.is(' '))
+        iter++;
+      if(!iter.is(')'))
         die("Missing closing ) for anonymous pattern");
       ++iter;
       tag_filter_t filter;
-      if(*iter == "[")
+      if(iter.is('['))
         filter = readTagFilter(iter, line);
       if(final_alternative && !alternation.empty())
       {
-        expand_alternation(pats_cur, alternation);
+        add_alternation(line_cur, alternation);
         alternation.clear();
       }
       pattern_element_t anon;
@@ -823,14 +1051,13 @@ LexdCompiler::processPattern(char_iter& iter, UnicodeString& line)
       anon.right = anon.left;
       anon.mode = readModifier(iter);
       anon.tag_filter = filter;
-      for(const auto &tok : distribute_tag_expressions(anon))
-        alternation.push_back(tok);
+      alternation.push_back(anon);
       --iter;
       currentPatternId = temp;
       final_alternative = true;
       just_sieved = false;
     }
-    else if(*iter == "?" || *iter == "*" || *iter == "+")
+    else if(iter.in(CC_MODIFIER))
     {
       die("Syntax error - unexpected modifier at u16 %d-%d", iter.span().first, iter.span().second);
     }
@@ -838,11 +1065,10 @@ LexdCompiler::processPattern(char_iter& iter, UnicodeString& line)
     {
       if(final_alternative && !alternation.empty())
       {
-        expand_alternation(pats_cur, alternation);
+        add_alternation(line_cur, alternation);
         alternation.clear();
       }
-      for(const auto &tok : distribute_tag_expressions(readPatternElement(iter, line)))
-        alternation.push_back(tok);
+      alternation.push_back(readPatternElement(iter, line));
       iter--;
       final_alternative = true;
       just_sieved = false;
@@ -852,67 +1078,62 @@ LexdCompiler::processPattern(char_iter& iter, UnicodeString& line)
     die("Syntax error - trailing |");
   if(just_sieved)
     die("Syntax error - trailing sieve (< or >)");
-  expand_alternation(pats_cur, alternation);
-  for(const auto &pat : pats_cur)
-  {
-    patterns[currentPatternId].push_back(make_pair(lineNumber, pat));
-  }
+  add_alternation(line_cur, alternation);
+  patterns[currentPatternId].push_back(make_pair(lineNumber, line_cur));
+}
+
+enum LineKind
+{
+  BodyLine,
+  PatternsHeader,
+  PatternHeader,
+  LexiconHeader,
+  AliasHeader
+};
+
+static LineKind
+line_kind(const UnicodeString& line)
+{
+  if(line == "PATTERNS" || line == "PATTERNS ")
+    return PatternsHeader;
+  else if(line.length() > 7 && line.startsWith("PATTERN "))
+    return PatternHeader;
+  else if(line.length() > 7 && line.startsWith("LEXICON "))
+    return LexiconHeader;
+  else if(line.length() >= 9 && line.startsWith("ALIAS "))
+    return AliasHeader;
+  return BodyLine;
 }
 
 void
 LexdCompiler::processNextLine()
 {
   UnicodeString line;
-  UChar c;
   bool escape = false;
-  bool comment = false;
-  bool lastWasSpace = false;
-  while((c = u_fgetc(input)) != '\n')
+  if(!input->readLine(line, escape))
   {
-    bool space = false;
-    if(c == U_EOF)
-    {
-      doneReading = true;
-      break;
-    }
-    if(comment) continue;
-    if(escape)
-    {
-      line += c;
-      escape = false;
-    }
-    else if(c == '\\')
-    {
-      escape = true;
-      line += c;
-    }
-    else if(c == '#')
-    {
-      comment = true;
-    }
-    else if(u_isWhitespace(c))
-    {
-      if(line.length() > 0 && !lastWasSpace)
-      {
-        line += ' ';
-      }
-      space = (line.length() > 0);
-    }
-    else line += c;
-    lastWasSpace = space;
+    doneReading = true;
+    return;
   }
   lineNumber++;
   if(escape) die("Trailing backslash");
+  processLine(line);
+}
+
+void
+LexdCompiler::processLine(UnicodeString& line)
+{
   if(line.length() == 0) return;
 
-  if(line == "PATTERNS" || line == "PATTERNS ")
+  const LineKind kind = line_kind(line);
+  if(kind == PatternsHeader)
   {
     finishLexicon();
     UnicodeString name = " ";
     currentPatternId = internName(name);
     inPat = true;
   }
-  else if(line.length() > 7 && line.startsWith("PATTERN "))
+  else if(kind == PatternHeader)
   {
     UnicodeString name = line.tempSubString(8);
     finishLexicon();
@@ -923,7 +1144,7 @@ LexdCompiler::processNextLine()
     }
     inPat = true;
   }
-  else if(line.length() > 7 && line.startsWith("LEXICON "))
+  else if(kind == LexiconHeader)
   {
     UnicodeString name = line.tempSubString(8);
     name.trim();
@@ -931,19 +1152,21 @@ LexdCompiler::processNextLine()
     if(name.length() > 1 && name.indexOf('[') != -1)
     {
       UnicodeString tags = name.tempSubString(name.indexOf('['));
-      auto c = char_iter(tags);
+      lexed_line lexed_tags(tags);
+      token_iter c(lexed_tags);
       currentLexicon_tags = readTags(c, tags);
-      if(c != c.end() && *c == ":")
+      if(c.is(':'))
       {
-        cerr << "WARNING: One-sided tags are deprecated and will soon be removed (line " << lineNumber << ")" << endl;
+        if(!worker)
+          cerr << "WARNING: One-sided tags are deprecated and will soon be removed (line " << lineNumber << ")" << endl;
         ++c;
-        if(*c == "[")
-          unionset_inplace(currentLexicon_tags, readTags(c, tags));
+        if(c.is('['))
+          currentLexicon_tags.add(readTags(c, tags));
 	else
           die("Expected start of default right tags '[' after ':'.");
       }
-      if(c != c.end())
-        die("Unexpected character '%C' after default tags.", (*c)[0]);
+      if(!c.at_end())
+        die("Unexpected character '%C' after default tags.", c.lead());
       name.retainBetween(0, name.indexOf('['));
     }
     currentLexiconPartCount = 1;
@@ -964,7 +1187,7 @@ LexdCompiler::processNextLine()
     }
     currentLexiconId = checkName(name);
     if(lexicons.find(currentLexiconId) != lexicons.end()) {
-      if(lexicons[currentLexiconId][0].size() != currentLexiconPartCount) {
+      if(lexicons[currentLexiconId].parts() != currentLexiconPartCount) {
         die("Multiple incompatible definitions for lexicon '%S'.", err(name));
       }
     }
@@ -975,7 +1198,7 @@ LexdCompiler::processNextLine()
     inLex = true;
     inPat = false;
   }
-  else if(line.length() >= 9 && line.startsWith("ALIAS "))
+  else if(kind == AliasHeader)
   {
     finishLexicon();
     if(line.endsWith(' ')) line.retainBetween(0, line.length()-1);
@@ -992,21 +1215,23 @@ LexdCompiler::processNextLine()
   }
   else if(inPat)
   {
-    char_iter iter = char_iter(line);
+    lexed_line lexed(line);
+    token_iter iter(lexed);
     processPattern(iter, line);
-    if(!iter.at_end() && (*iter).length() > 0)
+    if(!iter.at_end())
       die("Unexpected %S", err(*iter));
   }
   else if(inLex)
   {
-    char_iter iter = char_iter(line);
+    lexed_line lexed(line);
+    token_iter iter(lexed);
     entry_t entry;
     for(unsigned int i = 0; i < currentLexiconPartCount; i++)
     {
       entry.push_back(processLexiconSegment(iter, line, i));
-      if (*iter == "]") die("Unexpected closing bracket.");
+      if (iter.is(']')) die("Unexpected closing bracket.");
     }
-    if(*iter == ' ') ++iter;
+    if(iter.is(' ')) ++iter;
     if(!iter.at_end())
       die("Lexicon entry has '%S' (found at u16 %d), more than %d components", err(*iter), iter.span().first, currentLexiconPartCount);
     currentLexicon.push_back(entry);
@@ -1014,17 +1239,76 @@ LexdCompiler::processNextLine()
   else die("Expected 'PATTERNS' or 'LEXICON'");
 }
 
+LexdCompiler::name_kind_t
+LexdCompiler::nameKind(string_ref n) const
+{
+  return ((unsigned int)n < nameKinds.size() ? nameKinds[(unsigned int)n] : NameUndefined);
+}
+
+// The token with each lexicon replaced by the one whose storage it
+// shares, which builds the same transducers. Two different lexicons
+// collated with each other are left alone, as the checks on collation
+// go by name.
+pattern_element_t
+LexdCompiler::sharedLexiconToken(pattern_element_t tok) const
+{
+  if(tok.left.name.valid() && tok.right.name.valid() && tok.left.name != tok.right.name)
+    return tok;
+  for(token_t *side : {&tok.left, &tok.right})
+    if((unsigned int)side->name < sharedLexicons.size() && sharedLexicons[(unsigned int)side->name].valid())
+      side->name = sharedLexicons[(unsigned int)side->name];
+  return tok;
+}
+
+// The id of tok in elementIds. The id an element carries is only
+// trusted while the element still equals what it was interned as, so a
+// copy whose tags have since been combined with others is interned
+// afresh, and one that is unchanged isn't hashed again.
+element_id_t
+LexdCompiler::elementId(const pattern_element_t& tok)
+{
+  const element_id_t id = {tok.id};
+  if(tok.id < elementIds.size() && elementIds[id] == tok)
+    return id;
+  return elementIds.intern(tok);
+}
+
+// The id of an element made from the one with id `id`: for kind 's' its
+// sharedLexiconToken(), for 'n' the element in Normal mode, and for 'u'
+// the element in Normal mode without its tag filter. Each is interned
+// once, the first time it's asked for.
+element_id_t
+LexdCompiler::derivedId(element_id_t id, char kind)
+{
+  const uint64_t key = ((uint64_t)id.i << 8) | (unsigned char)kind;
+  auto it = derivedIds.find(key);
+  if(it != derivedIds.end())
+    return it->second;
+  pattern_element_t tok = elementIds[id];
+  if(kind == 's')
+    tok = sharedLexiconToken(tok);
+  else
+  {
+    tok.mode = Normal;
+    if(kind == 'u')
+      tok.tag_filter = tag_filter_t();
+  }
+  const element_id_t derived = elementIds.intern(tok);
+  derivedIds[key] = derived;
+  return derived;
+}
+
 bool
 LexdCompiler::isLexiconToken(const pattern_element_t& tok)
 {
-  const bool llex = (tok.left.name.empty() || (lexicons.find(tok.left.name) != lexicons.end()));
-  const bool rlex = (tok.right.name.empty() || (lexicons.find(tok.right.name) != lexicons.end()));
+  const bool llex = (tok.left.name.empty() || nameKind(tok.left.name) == NameLexicon);
+  const bool rlex = (tok.right.name.empty() || nameKind(tok.right.name) == NameLexicon);
   if(llex && rlex)
   {
     return true;
   }
-  const bool lpat = (patterns.find(tok.left.name) != patterns.end());
-  const bool rpat = (patterns.find(tok.right.name) != patterns.end());
+  const bool lpat = (nameKind(tok.left.name) == NamePattern);
+  const bool rpat = (nameKind(tok.right.name) == NamePattern);
   if(tok.left.name == tok.right.name && lpat && rpat)
   {
     if(tok.left.part != 1 || tok.right.part != 1)
@@ -1053,11 +1337,11 @@ LexdCompiler::isLexiconToken(const pattern_element_t& tok)
   else
   {
     cerr << "Patterns: ";
-    for(auto pat: patterns)
+    for(const auto &pat: patterns)
       cerr << to_ustring(name(pat.first)) << " ";
     cerr << endl;
     cerr << "Lexicons: ";
-    for(auto l: lexicons)
+    for(const auto &l: lexicons)
       cerr << to_ustring(name(l.first)) << " ";
     cerr << endl;
     die("Lexicon or pattern '%S' is not defined.", err(name((llex || lpat) ? tok.right.name : tok.left.name)));
@@ -1068,23 +1352,45 @@ LexdCompiler::isLexiconToken(const pattern_element_t& tok)
 }
 
 void
-LexdCompiler::buildPattern(int state, Transducer* t, const pattern_t& pat, const vector<int> is_free, unsigned int pos)
+LexdCompiler::buildPattern(int state, Transducer* t, const pattern_t& pat, const vector<int>& is_free, unsigned int pos, suffix_memo_t& memo)
 {
   if(pos == pat.size())
   {
     t->setFinal(state);
     return;
   }
+  if(!matchedParts.empty())
+  {
+    // the rest of the line only depends on the entries chosen for the
+    // names it has yet to use
+    vector<unsigned int> chosen;
+    chosen.reserve(memo.live[pos].size());
+    for(string_ref n : memo.live[pos])
+    {
+      auto it = matchedParts.find(n);
+      chosen.push_back(it == matchedParts.end() ? UINT_MAX : it->second);
+    }
+    auto it = memo.states.emplace(make_pair(pos, chosen), 0);
+    if(!it.second)
+    {
+      t->linkStates(state, it.first->second, 0);
+      return;
+    }
+    // start from a new state, since whatever led here may also leave
+    // from `state`, and that mustn't be shared
+    state = t->insertNewSingleTransduction(0, state);
+    it.first->second = state;
+  }
   const pattern_element_t& tok = pat[pos];
   if(tok.left.name == left_sieve_name)
   {
     t->linkStates(t->getInitial(), state, 0);
-    buildPattern(state, t, pat, is_free, pos+1);
+    buildPattern(state, t, pat, is_free, pos+1, memo);
   }
   else if(tok.left.name == right_sieve_name)
   {
     t->setFinal(state);
-    buildPattern(state, t, pat, is_free, pos+1);
+    buildPattern(state, t, pat, is_free, pos+1, memo);
   }
   else if(isLexiconToken(tok))
   {
@@ -1094,7 +1400,7 @@ LexdCompiler::buildPattern(int state, Transducer* t, const pattern_t& pat, const
       if(lex)
       {
         int new_state = t->insertTransducer(state, *lex);
-        buildPattern(new_state, t, pat, is_free, pos+1);
+        buildPattern(new_state, t, pat, is_free, pos+1, memo);
       }
       return;
     }
@@ -1115,7 +1421,7 @@ LexdCompiler::buildPattern(int state, Transducer* t, const pattern_t& pat, const
           }
           if(tok.left.name.valid()) matchedParts[tok.left.name] = index;
           if(tok.right.name.valid()) matchedParts[tok.right.name] = index;
-          buildPattern(new_state, t, pat, is_free, pos+1);
+          buildPattern(new_state, t, pat, is_free, pos+1, memo);
         }
       }
       if(tok.left.name.valid()) matchedParts.erase(tok.left.name);
@@ -1132,7 +1438,7 @@ LexdCompiler::buildPattern(int state, Transducer* t, const pattern_t& pat, const
     if(lex)
     {
       int new_state = t->insertTransducer(state, *lex);
-      buildPattern(new_state, t, pat, is_free, pos+1);
+      buildPattern(new_state, t, pat, is_free, pos+1, memo);
     }
     return;
   }
@@ -1146,31 +1452,20 @@ LexdCompiler::buildPattern(int state, Transducer* t, const pattern_t& pat, const
         t->linkStates(state, new_state, 0);
       if(tok.mode & Repeated)
         t->linkStates(new_state, state, 0);
-      buildPattern(new_state, t, pat, is_free, pos+1);
+      buildPattern(new_state, t, pat, is_free, pos+1, memo);
     }
   }
 }
 
 vector<int>
-LexdCompiler::determineFreedom(pattern_t& pat)
+LexdCompiler::determineFreedom(const pattern_t& pat, const line_info_t& info)
 {
+  if(info.all_free)
+    return vector<int>(pat.size(), 1);
   vector<int> is_free = vector<int>(pat.size(), 0);
-  map<string_ref, bool> is_optional;
   for(unsigned int i = 0; i < pat.size(); i++)
   {
     const pattern_element_t& t1 = pat[i];
-    if (is_optional.find(t1.left.name) != is_optional.end() && is_optional[t1.left.name] != t1.optional()) {
-      die("Lexicon %S cannot be both optional and non-optional in a single pattern.", err(name(t1.left.name)));
-    }
-    if (is_optional.find(t1.right.name) != is_optional.end() && is_optional[t1.right.name] != t1.optional()) {
-      die("Lexicon %S cannot be both optional and non-optional in a single pattern.", err(name(t1.right.name)));
-    }
-    if (t1.left.name.valid()) {
-      is_optional[t1.left.name] = t1.optional();
-    }
-    if (t1.right.name.valid()) {
-      is_optional[t1.right.name] = t1.optional();
-    }
     if(is_free[i] != 0)
       continue;
     for(unsigned int j = i+1; j < pat.size(); j++)
@@ -1188,119 +1483,366 @@ LexdCompiler::determineFreedom(pattern_t& pat)
   return is_free;
 }
 
-Transducer*
-LexdCompiler::buildPattern(const pattern_element_t &tok)
+// True if the line can be built by buildPatternLine(), without going
+// through its expansions one by one. That needs every lexicon in every
+// expansion to be free, so no name may appear at two positions. It also
+// needs each repeated pattern to have the state before it to itself:
+// the pattern loops back there, and so does anything else that leaves
+// from it, including whatever the previous element loops back to. So a
+// repeated pattern can neither have alternatives nor follow a position
+// that has them.
+bool
+LexdCompiler::isSharableLine(const pattern_line_t& line)
 {
-  if(tok.left.part != 1 || tok.right.part != 1)
-    die("Cannot build collated pattern %S", err(name(tok.left.name)));
-  if(patternTransducers.find(tok) == patternTransducers.end())
+  map<string_ref, size_t> position;
+  bool after_branch = false;
+  for(size_t k = 0; k < line.size(); k++)
   {
-    if (verbose) cerr << "Compiling " << to_ustring(printPattern(tok)) << endl;
-    auto start_time = chrono::steady_clock::now();
-    Transducer* t = new Transducer();
-    patternTransducers[tok] = NULL;
-    map<string_ref, unsigned int> tempMatch;
-    tempMatch.swap(matchedParts);
-    for(auto &pat_untagged : patterns[tok.left.name])
+    const bool branch = (line[k].size() > 1);
+    for(const pattern_element_t& tok : line[k])
     {
-      for(unsigned int i = 0; i < pat_untagged.second.size(); i++)
+      if((branch || after_branch) && (tok.mode & Repeated) &&
+         patterns.find(tok.left.name) != patterns.end())
+        return false;
+      for(string_ref n : {tok.left.name, tok.right.name})
       {
-        auto pat = pat_untagged;
-        bool taggable = true;
-        for (unsigned int j = 0; j < pat.second.size(); j++) {
-          auto& pair = pat.second[j];
-          if(!pair.tag_filter.combine(tok.tag_filter.neg())) {
-            taggable = false;
-            if (verbose) {
-              cerr << "Warning: The tags of " << to_ustring(printPattern(tok));
-              cerr << " conflict with " << to_ustring(printPattern(pat_untagged.second[j]));
-              cerr << " on line " << pat.first << "." << endl;
-            }
-          }
-        }
-        if(!pat.second[i].tag_filter.combine(tok.tag_filter.pos())) {
-          taggable = false;
-          if (verbose) {
-            cerr << "Warning: The tags of " << to_ustring(printPattern(tok));
-            cerr << " conflict with " << to_ustring(printPattern(pat_untagged.second[i]));
-            cerr << " on line " << pat.first << "." << endl;
-          }
-        }
-        if (!taggable) continue;
-
-        matchedParts.clear();
-        lineNumber = pat.first;
-        vector<int> is_free = determineFreedom(pat.second);
-        buildPattern(t->getInitial(), t, pat.second, is_free, 0);
+        if(n.empty() || n == left_sieve_name || n == right_sieve_name)
+          continue;
+        auto it = position.emplace(n, k);
+        if(it.first->second != k)
+          return false;
       }
     }
-    tempMatch.swap(matchedParts);
-    if(!t->hasNoFinals())
-    {
-      if (verbose)
-        cerr << "Minimizing " << to_ustring(printPattern(tok)) << endl;
-      t->minimize();
-    }
-    else if (verbose) {
-      cerr << "Warning: " << to_ustring(printPattern(tok));
-      cerr << " is empty." << endl;
-    }
-    patternTransducers[tok] = t;
-    if (verbose) {
-      auto end_time = chrono::steady_clock::now();
-      chrono::duration<double> diff = end_time - start_time;
-      cerr << "Done compiling " << to_ustring(printPattern(tok));
-      cerr << " in " << diff.count() << " seconds." << endl;
-    }
-  }
-  else if(patternTransducers[tok] == NULL)
-  {
-    die("Cannot compile self-recursive %S", err(printPattern(tok)));
+    // sieves don't move on to a new state
+    if(line[k][0].left.name != left_sieve_name &&
+       line[k][0].left.name != right_sieve_name)
+      after_branch = branch;
   }
-  return patternTransducers[tok];
+  return true;
 }
 
-int
-LexdCompiler::insertPreTags(Transducer* t, int state, tag_filter_t &tags)
+// Gets the transducer for each alternative in the order a depth-first
+// walk over the line's expansions would first reach it, so that symbols
+// are numbered just as they would be if the line were expanded. Every
+// expansion sharing a prefix continues the same way, so each position
+// only needs walking once. parts[pos] stays empty if nothing reaches it.
+void
+LexdCompiler::resolvePatternLine(const pattern_line_t& line, unsigned int pos, vector<vector<Transducer*>>& parts)
 {
-  int end = state;
-  for(auto tag : tags.pos())
-  {
-    trans_sym_t flag = getFlag(Positive, tag, 1);
-    end = t->insertSingleTransduction((int)alphabet_lookup(flag, flag), end);
-  }
-  for(auto tag : tags.neg())
+  if(pos == line.size() || !parts[pos].empty())
+    return;
+  for(const pattern_element_t& tok : line[pos])
   {
-    trans_sym_t flag = getFlag(Positive, tag, 2);
-    end = t->insertSingleTransduction((int)alphabet_lookup(flag, flag), end);
+    const bool sieve = (tok.left.name == left_sieve_name || tok.left.name == right_sieve_name);
+    Transducer* part = NULL;
+    if(sieve)
+      ;
+    else if(isLexiconToken(tok))
+      part = getLexiconTransducer(tok, 0, true);
+    else
+    {
+      part = buildPattern(tok);
+      if(part->hasNoFinals())
+        part = NULL;
+    }
+    parts[pos].push_back(part);
+    if(part != NULL || sieve)
+      resolvePatternLine(line, pos+1, parts);
   }
-  return end;
 }
 
-int
-LexdCompiler::insertPostTags(Transducer* t, int state, tag_filter_t &tags)
+// Builds a line with each set of alternatives inserted once, all of
+// them leaving from the same state and meeting again at the next, so
+// the size of the result is linear in the length of the line rather
+// than in its number of expansions.
+void
+LexdCompiler::buildPatternLine(Transducer* t, const pattern_line_t& line)
 {
-  int end = 0;
-  int flag_dest = 0;
-  for(auto tag : tags.pos())
+  vector<vector<Transducer*>> parts(line.size());
+  resolvePatternLine(line, 0, parts);
+  int state = t->getInitial();
+  for(size_t k = 0; k < line.size(); k++)
   {
-    trans_sym_t flag = getFlag(Disallow, tag, 1);
-    trans_sym_t clear = getFlag(Clear, tag, 0);
-    if(flag_dest == 0)
+    const auto& alternatives = line[k];
+    if(alternatives[0].left.name == left_sieve_name)
     {
-      flag_dest = t->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
-      end = flag_dest;
+      t->linkStates(t->getInitial(), state, 0);
+      continue;
     }
-    else
+    else if(alternatives[0].left.name == right_sieve_name)
     {
-      t->linkStates(state, flag_dest, (int)alphabet_lookup(flag, flag));
+      t->setFinal(state);
+      continue;
     }
-    end = t->insertSingleTransduction((int)alphabet_lookup(clear, clear), end);
-  }
-  if(end == 0)
-  {
-    end = state;
-  }
+    int join = -1;
+    for(size_t a = 0; a < parts[k].size(); a++)
+    {
+      if(parts[k][a] == NULL)
+        continue;
+      const pattern_element_t& tok = alternatives[a];
+      int end = t->insertTransducer(state, *parts[k][a]);
+      if(!isLexiconToken(tok))
+      {
+        if(tok.mode & Optional)
+          t->linkStates(state, end, 0);
+        if(tok.mode & Repeated)
+          t->linkStates(end, state, 0);
+      }
+      if(alternatives.size() == 1)
+        join = end;
+      else
+      {
+        if(join == -1)
+          join = t->newState();
+        t->linkStates(end, join, 0);
+      }
+    }
+    if(join == -1)
+      return;
+    state = join;
+  }
+  t->setFinal(state);
+}
+
+static bool
+leadsToInitial(Transducer* t)
+{
+  const int initial = t->getInitial();
+  for(auto &state : t->getTransitions())
+    for(auto &tr : state.second)
+      if(tr.second.first == initial)
+        return true;
+  return false;
+}
+
+// Minimizes a pattern part-way through once it has grown past `limit`
+// states, so that its size follows the size of the result rather than
+// the number of expansions. Each line goes in from the initial state, so
+// this is only safe while nothing leads back there; otherwise the lines
+// still to come could follow on from the ones already built, and
+// minimizing would change that.
+void
+LexdCompiler::stageMinimize(Transducer* t, size_t& limit)
+{
+  if(t->getTransitions().size() < limit || t->hasNoFinals())
+    return;
+  if(leadsToInitial(t))
+  {
+    limit = SIZE_MAX;
+    return;
+  }
+  minimizeTransducer(t);
+  if(leadsToInitial(t))
+  {
+    Transducer fresh;
+    fresh.setFinal(fresh.insertTransducer(fresh.getInitial(), *t));
+    *t = fresh;
+  }
+  // don't minimize over and over as the pattern nears the limit
+  limit = max(stageStates, 2 * t->getTransitions().size());
+}
+
+Transducer*
+LexdCompiler::buildPattern(const pattern_element_t &tok)
+{
+  if(tok.left.part != 1 || tok.right.part != 1)
+    die("Cannot build collated pattern %S", err(name(tok.left.name)));
+  const element_id_t id = elementId(tok);
+  if(patternTransducers.find(id) == nullptr)
+  {
+    string key;
+    cache_log_t log;
+    if(caching())
+    {
+      key = cacheKey(tok, 'p');
+      vector<Transducer*> cached;
+      if(loadCached(key, cached))
+        return patternTransducers[id] = cached[0];
+      cacheLogs.push_back(&log);
+    }
+    if (verbose) cerr << "Compiling " << to_ustring(printPattern(tok)) << endl;
+    auto start_time = chrono::steady_clock::now();
+    Transducer* t = new Transducer();
+    patternTransducers[id] = NULL;
+    map<string_ref, unsigned int> tempMatch;
+    tempMatch.swap(matchedParts);
+    size_t limit = stageStates;
+    auto &lines = patterns[tok.left.name];
+    const auto &infos = lineInfo[tok.left.name];
+    for(size_t l = 0; l < lines.size(); l++)
+    {
+      auto &line_untagged = lines[l];
+      // Positive tags go to each position in turn, and for every
+      // expansion of the line before the next one; a line with
+      // alternatives is only built whole if that order can't matter.
+      bool shared = infos[l].sharable;
+      for(unsigned int j = 0; shared && j < line_untagged.second.size(); j++)
+        if(line_untagged.second[j].size() > 1 && !tok.tag_filter.pos().empty())
+          shared = false;
+      if(shared)
+      {
+        // without positive tags every pass through here would be the same
+        unsigned int count = line_untagged.second.size();
+        if(tok.tag_filter.pos().empty() && count > 1)
+          count = 1;
+        for(unsigned int i = 0; i < count; i++)
+        {
+          auto pat = line_untagged;
+          bool taggable = true;
+          for (unsigned int j = 0; j < pat.second.size(); j++) {
+            // drop the alternatives the tags rule out; the line only
+            // fails if that leaves some position with none at all
+            vector<pattern_element_t> kept;
+            for (auto& pair : pat.second[j]) {
+              bool ok = pair.tag_filter.combine(tok.tag_filter.neg());
+              if(i == j && !pair.tag_filter.combine(tok.tag_filter.pos()))
+                ok = false;
+              if(ok)
+                kept.push_back(pair);
+              else if (verbose) {
+                cerr << "Warning: The tags of " << to_ustring(printPattern(tok));
+                cerr << " conflict with " << to_ustring(printPattern(pair));
+                cerr << " on line " << pat.first << "." << endl;
+              }
+            }
+            if(kept.empty())
+              taggable = false;
+            pat.second[j].swap(kept);
+          }
+          if (!taggable) continue;
+
+          lineNumber = pat.first;
+          buildPatternLine(t, pat.second);
+          stageMinimize(t, limit);
+        }
+        continue;
+      }
+      for(line_expansion_t e(line_untagged.second); !e.at_end(); e.next())
+      {
+        pair<line_number_t, pattern_t> pat_untagged(line_untagged.first, *e);
+        // tags don't change which names are shared
+        const vector<int> is_free = determineFreedom(pat_untagged.second, infos[l]);
+        suffix_memo_t memo;
+        memo.live.resize(pat_untagged.second.size());
+        set<string_ref> names;
+        for(size_t j = pat_untagged.second.size(); j > 0; j--)
+        {
+          const pattern_element_t& elem = pat_untagged.second[j-1];
+          if(is_free[j-1] != 1 && elem.left.name != left_sieve_name &&
+             elem.left.name != right_sieve_name && isLexiconToken(elem))
+          {
+            if(elem.left.name.valid())
+              names.insert(elem.left.name);
+            if(elem.right.name.valid())
+              names.insert(elem.right.name);
+          }
+          memo.live[j-1].assign(names.begin(), names.end());
+        }
+        for(unsigned int i = 0; i < pat_untagged.second.size(); i++)
+        {
+          auto pat = pat_untagged;
+          bool taggable = true;
+          for (unsigned int j = 0; j < pat.second.size(); j++) {
+            auto& pair = pat.second[j];
+            if(!pair.tag_filter.combine(tok.tag_filter.neg())) {
+              taggable = false;
+              if (verbose) {
+                cerr << "Warning: The tags of " << to_ustring(printPattern(tok));
+                cerr << " conflict with " << to_ustring(printPattern(pat_untagged.second[j]));
+                cerr << " on line " << pat.first << "." << endl;
+              }
+            }
+          }
+          if(!pat.second[i].tag_filter.combine(tok.tag_filter.pos())) {
+            taggable = false;
+            if (verbose) {
+              cerr << "Warning: The tags of " << to_ustring(printPattern(tok));
+              cerr << " conflict with " << to_ustring(printPattern(pat_untagged.second[i]));
+              cerr << " on line " << pat.first << "." << endl;
+            }
+          }
+          if (!taggable) continue;
+
+          matchedParts.clear();
+          lineNumber = pat.first;
+          memo.states.clear();
+          buildPattern(t->getInitial(), t, pat.second, is_free, 0, memo);
+          stageMinimize(t, limit);
+        }
+      }
+    }
+    tempMatch.swap(matchedParts);
+    if(!t->hasNoFinals())
+    {
+      if (verbose)
+        cerr << "Minimizing " << to_ustring(printPattern(tok)) << endl;
+      minimizeTransducer(t);
+    }
+    else if (verbose) {
+      cerr << "Warning: " << to_ustring(printPattern(tok));
+      cerr << " is empty." << endl;
+    }
+    patternTransducers[id] = t;
+    if(caching())
+    {
+      cacheLogs.pop_back();
+      saveCached(key, log, vector<Transducer*>(1, t));
+    }
+    if (verbose) {
+      auto end_time = chrono::steady_clock::now();
+      chrono::duration<double> diff = end_time - start_time;
+      cerr << "Done compiling " << to_ustring(printPattern(tok));
+      cerr << " in " << diff.count() << " seconds." << endl;
+    }
+  }
+  else if(*patternTransducers.find(id) == NULL)
+  {
+    die("Cannot compile self-recursive %S", err(printPattern(tok)));
+  }
+  return *patternTransducers.find(id);
+}
+
+int
+LexdCompiler::insertPreTags(Transducer* t, int state, tag_filter_t &tags)
+{
+  int end = state;
+  for(auto tag : tags.pos())
+  {
+    trans_sym_t flag = getFlag(Positive, tag, 1);
+    end = t->insertSingleTransduction((int)alphabet_lookup(flag, flag), end);
+  }
+  for(auto tag : tags.neg())
+  {
+    trans_sym_t flag = getFlag(Positive, tag, 2);
+    end = t->insertSingleTransduction((int)alphabet_lookup(flag, flag), end);
+  }
+  return end;
+}
+
+int
+LexdCompiler::insertPostTags(Transducer* t, int state, tag_filter_t &tags)
+{
+  int end = 0;
+  int flag_dest = 0;
+  for(auto tag : tags.pos())
+  {
+    trans_sym_t flag = getFlag(Disallow, tag, 1);
+    trans_sym_t clear = getFlag(Clear, tag, 0);
+    if(flag_dest == 0)
+    {
+      flag_dest = t->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
+      end = flag_dest;
+    }
+    else
+    {
+      t->linkStates(state, flag_dest, (int)alphabet_lookup(flag, flag));
+    }
+    end = t->insertSingleTransduction((int)alphabet_lookup(clear, clear), end);
+  }
+  if(end == 0)
+  {
+    end = state;
+  }
   for(auto tag : tags.neg())
   {
     trans_sym_t clear = getFlag(Clear, tag, 0);
@@ -1312,189 +1854,201 @@ LexdCompiler::insertPostTags(Transducer* t, int state, tag_filter_t &tags)
 Transducer*
 LexdCompiler::buildPatternWithFlags(const pattern_element_t &tok, int pattern_start_state = 0)
 {
-  if(patternTransducers.find(tok) == patternTransducers.end())
+  const element_id_t id = elementId(tok);
+  if(patternTransducers.find(id) == nullptr)
   {
     if (verbose) cerr << "Compiling " << to_ustring(printPattern(tok)) << endl;
     auto start_time = chrono::steady_clock::now();
     Transducer* trans = (shouldHypermin ? hyperminTrans : new Transducer());
-    patternTransducers[tok] = NULL;
+    patternTransducers[id] = NULL;
     unsigned int transition_index = 0;
     vector<int> pattern_finals;
     bool did_anything = false;
-    for(auto& pat : patterns[tok.left.name])
-    {
-      lineNumber = pat.first;
-      vector<int> is_free = determineFreedom(pat.second);
-      bool got_non_null = false;
-      unsigned int count = (tok.tag_filter.pos().size() > 0 ? pat.second.size() : 1);
-      if(tagsAsFlags) count = 1;
-      for(unsigned int idx = 0; idx < count; idx++)
+    auto &lines = patterns[tok.left.name];
+    const auto &infos = lineInfo[tok.left.name];
+    for(size_t l = 0; l < lines.size(); l++)
+    {
+      auto& line = lines[l];
+      for(line_expansion_t e(line.second); !e.at_end(); e.next())
       {
-        int state = pattern_start_state;
-        vector<int> finals;
-        set<string_ref> to_clear;
-        bool got_null = false;
-        for(unsigned int i = 0; i < pat.second.size(); i++)
+        pair<line_number_t, pattern_t> pat(line.first, *e);
+        lineNumber = pat.first;
+        vector<int> is_free = determineFreedom(pat.second, infos[l]);
+        bool got_non_null = false;
+        unsigned int count = (tok.tag_filter.pos().size() > 0 ? pat.second.size() : 1);
+        if(tagsAsFlags) count = 1;
+        for(unsigned int idx = 0; idx < count; idx++)
         {
-          pattern_element_t cur = pat.second[i];
-
-          if(cur.left.name == left_sieve_name)
-          {
-            trans->linkStates(pattern_start_state, state, 0);
-            continue;
-          }
-          else if(cur.left.name == right_sieve_name)
+          int state = pattern_start_state;
+          vector<int> finals;
+          set<string_ref> to_clear;
+          bool got_null = false;
+          for(unsigned int i = 0; i < pat.second.size(); i++)
           {
-            finals.push_back(state);
-            continue;
-          }
+            pattern_element_t cur = pat.second[i];
 
-          bool isLex = isLexiconToken(cur);
+            if(cur.left.name == left_sieve_name)
+            {
+              trans->linkStates(pattern_start_state, state, 0);
+              continue;
+            }
+            else if(cur.left.name == right_sieve_name)
+            {
+              finals.push_back(state);
+              continue;
+            }
 
-          transition_index++;
+            bool isLex = isLexiconToken(cur);
 
-          int mode_start = state;
-          cur.mode = Normal;
+            transition_index++;
 
-          tag_filter_t current_tags;
-          if(tagsAsFlags)
-          {
-            state = insertPreTags(trans, state, cur.tag_filter);
-            current_tags = cur.tag_filter;
-            cur.tag_filter = tag_filter_t();
-          }
-          else
-          {
-            if (i == idx && !cur.tag_filter.combine(tok.tag_filter.pos())) {
-              if (verbose) {
-                cerr << "Warning: The tags of " << to_ustring(printPattern(tok));
-                cerr << " conflict with " << to_ustring(printPattern(pat.second[i]));
-                cerr << " on line " << pat.first << "." << endl;
-              }
-            }
-            if (!cur.tag_filter.combine(tok.tag_filter.neg())) {
-              if (verbose) {
-                cerr << "Warning: The tags of " << to_ustring(printPattern(tok));
-                cerr << " conflict with " << to_ustring(printPattern(pat.second[i]));
-                cerr << " on line " << pat.first << "." << endl;
-              }
-            }
-          }
+            const element_id_t parsed_id = elementId(pat.second[i]);
+            int mode_start = state;
+            cur.mode = Normal;
+            cur.id = derivedId(parsed_id, 'n').i;
 
-          Transducer* t;
-          if(shouldHypermin)
-          {
-            trans_sym_t inflag = getFlag(Positive, tok.left.name, transition_index);
-            trans_sym_t outflag = getFlag(Require, tok.left.name, transition_index);
-            int in_tr = (int)alphabet_lookup(inflag, inflag);
-            int out_tr = (int)alphabet_lookup(outflag, outflag);
-            if(is_free[i] == -1 && isLex)
+            tag_filter_t current_tags;
+            if(tagsAsFlags)
             {
-              to_clear.insert(cur.left.name);
-              to_clear.insert(cur.right.name);
+              state = insertPreTags(trans, state, cur.tag_filter);
+              current_tags = cur.tag_filter;
+              cur.tag_filter = tag_filter_t();
+              cur.id = derivedId(parsed_id, 'u').i;
             }
-            if(transducerLocs.find(cur) != transducerLocs.end())
+            else
             {
-              auto loc = transducerLocs[cur];
-              if(loc.first == loc.second)
-              {
-                t = NULL;
+              if (i == idx && !cur.tag_filter.combine(tok.tag_filter.pos())) {
+                if (verbose) {
+                  cerr << "Warning: The tags of " << to_ustring(printPattern(tok));
+                  cerr << " conflict with " << to_ustring(printPattern(pat.second[i]));
+                  cerr << " on line " << pat.first << "." << endl;
+                }
               }
-              else
-              {
-                t = trans;
-                trans->linkStates(state, loc.first, in_tr);
-                state = trans->insertSingleTransduction(out_tr, loc.second);
+              if (!cur.tag_filter.combine(tok.tag_filter.neg())) {
+                if (verbose) {
+                  cerr << "Warning: The tags of " << to_ustring(printPattern(tok));
+                  cerr << " conflict with " << to_ustring(printPattern(pat.second[i]));
+                  cerr << " on line " << pat.first << "." << endl;
+                }
               }
             }
-            else
+
+            Transducer* t;
+            if(shouldHypermin)
             {
-              int start = trans->insertSingleTransduction(in_tr, state);
-              int end = start;
-              if(isLex)
+              trans_sym_t inflag = getFlag(Positive, tok.left.name, transition_index);
+              trans_sym_t outflag = getFlag(Require, tok.left.name, transition_index);
+              int in_tr = (int)alphabet_lookup(inflag, inflag);
+              int out_tr = (int)alphabet_lookup(outflag, outflag);
+              if(is_free[i] == -1 && isLex)
+              {
+                to_clear.insert(cur.left.name);
+                to_clear.insert(cur.right.name);
+              }
+              const element_id_t cur_id = elementId(cur);
+              if(transducerLocs.find(cur_id) != nullptr)
               {
-                t = getLexiconTransducerWithFlags(cur, false);
-                if(t == NULL)
+                auto loc = *transducerLocs.find(cur_id);
+                if(loc.first == loc.second)
                 {
-                  transducerLocs[cur] = make_pair(start, start);
+                  t = NULL;
                 }
                 else
                 {
-                  end = trans->insertTransducer(start, *t);
-                  transducerLocs[cur] = make_pair(start, end);
+                  t = trans;
+                  trans->linkStates(state, loc.first, in_tr);
+                  state = trans->insertSingleTransduction(out_tr, loc.second);
                 }
               }
               else
               {
-                t = buildPatternWithFlags(cur, start);
-                end = transducerLocs[cur].second;
+                int start = trans->insertSingleTransduction(in_tr, state);
+                int end = start;
+                if(isLex)
+                {
+                  t = getLexiconTransducerWithFlags(cur, false);
+                  if(t == NULL)
+                  {
+                    transducerLocs[cur_id] = make_pair(start, start);
+                  }
+                  else
+                  {
+                    end = trans->insertTransducer(start, *t);
+                    transducerLocs[cur_id] = make_pair(start, end);
+                  }
+                }
+                else
+                {
+                  t = buildPatternWithFlags(cur, start);
+                  end = transducerLocs[cur_id].second;
+                }
+                state = trans->insertSingleTransduction(out_tr, end);
               }
-              state = trans->insertSingleTransduction(out_tr, end);
             }
-          }
-          else if(isLex)
-          {
-            t = getLexiconTransducerWithFlags(cur, (is_free[i] == 1));
-            if(is_free[i] == -1)
+            else if(isLex)
             {
-              to_clear.insert(cur.left.name);
-              to_clear.insert(cur.right.name);
+              t = getLexiconTransducerWithFlags(cur, (is_free[i] == 1));
+              if(is_free[i] == -1)
+              {
+                to_clear.insert(cur.left.name);
+                to_clear.insert(cur.right.name);
+              }
+            }
+            else
+            {
+              t = buildPatternWithFlags(cur);
+            }
+            if(t == NULL || (!shouldHypermin && t->hasNoFinals()))
+            {
+              got_null = true;
+              break;
+            }
+            got_non_null = true;
+            if(!shouldHypermin)
+            {
+              state = trans->insertTransducer(state, *t);
+            }
+            if(tagsAsFlags)
+            {
+              state = insertPostTags(trans, state, current_tags);
+            }
+            if(pat.second[i].mode & Optional)
+            {
+              trans->linkStates(mode_start, state, 0);
+            }
+            if(pat.second[i].mode & Repeated)
+            {
+              trans->linkStates(state, mode_start, 0);
             }
           }
-          else
-          {
-            t = buildPatternWithFlags(cur);
-          }
-          if(t == NULL || (!shouldHypermin && t->hasNoFinals()))
-          {
-            got_null = true;
-            break;
-          }
-          got_non_null = true;
-          if(!shouldHypermin)
-          {
-            state = trans->insertTransducer(state, *t);
-          }
-          if(tagsAsFlags)
-          {
-            state = insertPostTags(trans, state, current_tags);
-          }
-          if(pat.second[i].mode & Optional)
-          {
-            trans->linkStates(mode_start, state, 0);
-          }
-          if(pat.second[i].mode & Repeated)
-          {
-            trans->linkStates(state, mode_start, 0);
-          }
-        }
-        if(!got_null || finals.size() > 0)
-        {
-          for(auto fin : finals)
-          {
-            trans->linkStates(fin, state, 0);
-          }
-          for(auto lex : to_clear)
+          if(!got_null || finals.size() > 0)
           {
-            if(lex.empty())
+            for(auto fin : finals)
             {
-              continue;
+              trans->linkStates(fin, state, 0);
+            }
+            for(auto lex : to_clear)
+            {
+              if(lex.empty())
+              {
+                continue;
+              }
+              UnicodeString flag = "@C.";
+              encodeFlag(flag, (int)lex.i);
+              flag += "@";
+              trans_sym_t f = alphabet_lookup(flag);
+              state = trans->insertSingleTransduction((int)alphabet_lookup(f, f), state);
             }
-            UnicodeString flag = "@C.";
-            encodeFlag(flag, (int)lex.i);
-            flag += "@";
-            trans_sym_t f = alphabet_lookup(flag);
-            state = trans->insertSingleTransduction((int)alphabet_lookup(f, f), state);
+            trans->setFinal(state);
+            pattern_finals.push_back(state);
           }
-          trans->setFinal(state);
-          pattern_finals.push_back(state);
         }
+        if(!got_non_null)
+        {
+          continue;
+        }
+        did_anything = true;
       }
-      if(!got_non_null)
-      {
-        continue;
-      }
-      did_anything = true;
     }
     if(did_anything)
     {
@@ -1514,9 +2068,7 @@ LexdCompiler::buildPatternWithFlags(const pattern_element_t &tok, int pattern_st
               trans->setFinal(fin, 0, false);
             }
           }
-          pattern_element_t key = tok;
-          key.mode = Normal;
-          transducerLocs[key] = make_pair(pattern_start_state, end);
+          transducerLocs[derivedId(id, 'n')] = make_pair(pattern_start_state, end);
         }
       }
       else
@@ -1524,7 +2076,7 @@ LexdCompiler::buildPatternWithFlags(const pattern_element_t &tok, int pattern_st
         if(!trans->hasNoFinals()) {
           if (verbose)
             cerr << "Minimizing " << to_ustring(printPattern(tok)) << endl;
-          trans->minimize();
+          minimizeTransducer(trans);
         }
       }
     }
@@ -1543,13 +2095,13 @@ LexdCompiler::buildPatternWithFlags(const pattern_element_t &tok, int pattern_st
       cerr << "Done compiling " << to_ustring(printPattern(tok));
       cerr << " in " << diff.count() << " seconds." << endl;
     }
-    patternTransducers[tok] = trans;
+    patternTransducers[id] = trans;
   }
-  else if(patternTransducers[tok] == NULL)
+  else if(*patternTransducers.find(id) == NULL)
   {
     die("Cannot compile self-recursive pattern '%S'", err(name(tok.left.name)));
   }
-  return patternTransducers[tok];
+  return *patternTransducers.find(id);
 }
 
 void
@@ -1557,222 +2109,1579 @@ LexdCompiler::buildAllLexicons()
 {
   // find out if there are any lexicons that we can build without flags
   vector<pattern_element_t> lexicons_to_build;
-  for(auto pattern : patterns)
+  for(auto &pattern : patterns)
   {
-    for(auto pat : pattern.second)
+    const auto &infos = lineInfo[pattern.first];
+    for(size_t l = 0; l < pattern.second.size(); l++)
     {
-      lineNumber = pat.first;
-      vector<int> free = determineFreedom(pat.second);
-      for(size_t i = 0; i < pat.second.size(); i++)
+      auto& line = pattern.second[l];
+      for(line_expansion_t e(line.second); !e.at_end(); e.next())
       {
-        if(pat.second[i].left.name == left_sieve_name ||
-           pat.second[i].left.name == right_sieve_name)
-        {
-          continue;
-        }
-        if(isLexiconToken(pat.second[i]))
+        pair<line_number_t, pattern_t> pat(line.first, *e);
+        lineNumber = pat.first;
+        vector<int> free = determineFreedom(pat.second, infos[l]);
+        for(size_t i = 0; i < pat.second.size(); i++)
         {
-          pattern_element_t& tok = pat.second[i];
-          if(free[i] == -1)
+          if(pat.second[i].left.name == left_sieve_name ||
+             pat.second[i].left.name == right_sieve_name)
           {
-            lexiconFreedom[tok.left.name] = false;
-            lexiconFreedom[tok.right.name] = false;
+            continue;
           }
-          else
+          if(isLexiconToken(pat.second[i]))
           {
-            if(lexiconFreedom.find(tok.left.name) == lexiconFreedom.end())
+            pattern_element_t& tok = pat.second[i];
+            if(free[i] == -1)
             {
-              lexiconFreedom[tok.left.name] = true;
+              lexiconFreedom[tok.left.name] = false;
+              lexiconFreedom[tok.right.name] = false;
             }
-            if(lexiconFreedom.find(tok.right.name) == lexiconFreedom.end())
+            else
             {
-              lexiconFreedom[tok.right.name] = true;
+              if(lexiconFreedom.find(tok.left.name) == lexiconFreedom.end())
+              {
+                lexiconFreedom[tok.left.name] = true;
+              }
+              if(lexiconFreedom.find(tok.right.name) == lexiconFreedom.end())
+              {
+                lexiconFreedom[tok.right.name] = true;
+              }
             }
+            lexicons_to_build.push_back(tok);
           }
-          lexicons_to_build.push_back(tok);
         }
       }
     }
   }
   lexiconFreedom[string_ref(0)] = true;
-  for(auto tok : lexicons_to_build)
+  for(auto &tok : lexicons_to_build)
   {
     tok.tag_filter = tag_filter_t();
     tok.mode = Normal;
-    bool free = ((tok.left.name.empty() || lexiconFreedom[tok.left.name]) &&
-                 (tok.right.name.empty() || lexiconFreedom[tok.right.name]));
-    getLexiconTransducerWithFlags(tok, free);
   }
+  auto isFree = [&](const pattern_element_t& tok) {
+    return ((tok.left.name.empty() || lexiconFreedom[tok.left.name]) &&
+            (tok.right.name.empty() || lexiconFreedom[tok.right.name]));
+  };
+  // the lexicons don't depend on each other, so with --jobs they (and
+  // the shards of the big ones) can all be built at once
+  prebuilt_store_t store;
+  if(jobs > 1)
+  {
+    prebuilt = &store;
+    prebuild_graph_t graph;
+    for(auto &tok : lexicons_to_build)
+      prebuildLexicon(graph, tok, isFree(tok) ? 'f' : 'g');
+    prebuild(graph);
+  }
+  for(auto &tok : lexicons_to_build)
+    getLexiconTransducerWithFlags(tok, isFree(tok));
+  prebuilt = nullptr;
 }
 
 int
 LexdCompiler::buildPatternSingleLexicon(pattern_element_t tok, int start_state)
 {
-  if(patternTransducers.find(tok) == patternTransducers.end() || patternTransducers[tok] != NULL)
+  const element_id_t id = elementId(tok);
+  if(patternTransducers.find(id) == nullptr || *patternTransducers.find(id) != NULL)
   {
-    patternTransducers[tok] = NULL;
+    patternTransducers[id] = NULL;
     int end = -1;
     string_ref transition_flag = internName(" ");
-    for(auto pattern : patterns[tok.left.name])
-    {
-      int next_start_state = start_state;
-      size_t next_start_idx = 0;
-      lineNumber = pattern.first;
-      set<string_ref> to_clear;
-      size_t count = (tok.tag_filter.pos().empty() ? 1 : pattern.second.size());
-      for(size_t tag_idx = 0; tag_idx < count; tag_idx++)
+    for(auto& line : patterns[tok.left.name])
+    {
+      for(line_expansion_t e(line.second); !e.at_end(); e.next())
       {
-        int state = next_start_state;
-        bool finished = true;
-        for(size_t i = next_start_idx; i < pattern.second.size(); i++)
+        pair<line_number_t, pattern_t> pattern(line.first, *e);
+        int next_start_state = start_state;
+        size_t next_start_idx = 0;
+        lineNumber = pattern.first;
+        set<string_ref> to_clear;
+        size_t count = (tok.tag_filter.pos().empty() ? 1 : pattern.second.size());
+        for(size_t tag_idx = 0; tag_idx < count; tag_idx++)
         {
-          pattern_element_t cur = pattern.second[i];
-
-          if(cur.left.name == left_sieve_name)
-          {
-            hyperminTrans->linkStates(start_state, state, 0);
-            continue;
-          }
-          else if(cur.left.name == right_sieve_name)
+          int state = next_start_state;
+          bool finished = true;
+          for(size_t i = next_start_idx; i < pattern.second.size(); i++)
           {
-            if(end == -1)
+            pattern_element_t cur = pattern.second[i];
+
+            if(cur.left.name == left_sieve_name)
             {
-              end = hyperminTrans->insertNewSingleTransduction(0, state);
+              hyperminTrans->linkStates(start_state, state, 0);
+              continue;
             }
-            else
+            else if(cur.left.name == right_sieve_name)
             {
-              hyperminTrans->linkStates(state, end, 0);
-            }
+              if(end == -1)
+              {
+                end = hyperminTrans->insertNewSingleTransduction(0, state);
+              }
+              else
+              {
+                hyperminTrans->linkStates(state, end, 0);
+              }
+              continue;
+            }
+
+            if(i == tag_idx)
+            {
+              next_start_state = state;
+              next_start_idx = tag_idx;
+              cur.tag_filter.combine(tok.tag_filter.pos());
+            }
+            cur.tag_filter.combine(tok.tag_filter.neg());
+
+            int mode_state = state;
+
+            if(isLexiconToken(cur))
+            {
+              tags_t tags = cur.tag_filter.tags();
+              for(auto tag : tags)
+              {
+                trans_sym_t flag = getFlag(Clear, tag, 0);
+                state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
+              }
+              const element_id_t untagged_id = derivedId(elementId(pattern.second[i]), 'u');
+              pattern_element_t untagged = elementIds[untagged_id];
+              untagged.id = untagged_id.i;
+              bool free = (lexiconFreedom[cur.left.name] && lexiconFreedom[cur.right.name]);
+              if(!free)
+              {
+                to_clear.insert(cur.left.name);
+                to_clear.insert(cur.right.name);
+              }
+              trans_sym_t inflag = getFlag(Positive, transition_flag, transitionCount);
+              trans_sym_t outflag = getFlag(Require, transition_flag, transitionCount);
+              transitionCount++;
+              if(transducerLocs.find(untagged_id) == nullptr)
+              {
+                state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(inflag, inflag), state);
+                Transducer* lex = getLexiconTransducerWithFlags(untagged, free);
+                int start = state;
+                state = hyperminTrans->insertTransducer(state, *lex);
+                transducerLocs[untagged_id] = make_pair(start, state);
+              }
+              else
+              {
+                auto loc = *transducerLocs.find(untagged_id);
+                hyperminTrans->linkStates(state, loc.first, (int)alphabet_lookup(inflag, inflag));
+                state = loc.second;
+              }
+              state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(outflag, outflag), state);
+              for(auto tag : cur.tag_filter.pos())
+              {
+                trans_sym_t flag = getFlag(Require, tag, 1);
+                state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
+              }
+              for(auto tag : cur.tag_filter.neg())
+              {
+                trans_sym_t flag = getFlag(Disallow, tag, 1);
+                state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
+              }
+            }
+            else
+            {
+              state = buildPatternSingleLexicon(cur, state);
+              if(state == -1)
+              {
+                finished = false;
+                break;
+              }
+            }
+
+            if(cur.mode & Optional)
+            {
+              hyperminTrans->linkStates(mode_state, state, 0);
+            }
+            if(cur.mode & Repeated)
+            {
+              hyperminTrans->linkStates(state, mode_state, 0);
+            }
+          }
+          if(finished)
+          {
+            for(auto lex : to_clear)
+            {
+              if(lex.empty())
+              {
+                continue;
+              }
+              trans_sym_t flag = getFlag(Clear, lex, 0);
+              state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
+            }
+            if(end == -1)
+            {
+              end = state;
+            }
+            else
+            {
+              hyperminTrans->linkStates(state, end, 0);
+            }
+          }
+        }
+      }
+    }
+    patternTransducers.erase(id);
+    return end;
+  }
+  else
+  {
+    die("Cannot compile self-recursive pattern '%S'", err(name(tok.left.name)));
+    return 0;
+  }
+}
+
+void
+LexdCompiler::readFile(FILE* infile)
+{
+  source_reader reader(infile);
+  const uint64_t source_hash = ir_hash(reader.bytes(), reader.length());
+  if(!irInput.empty() && readIR(source_hash))
+    return;
+  input = &reader;
+  doneReading = false;
+  if(jobs > 1)
+    readLinesParallel();
+  else
+  {
+    while(!doneReading)
+      processNextLine();
+  }
+  finishLexicon();
+  input = nullptr;
+  if(!irOutput.empty())
+    writeIR(source_hash);
+}
+
+static void
+write_tag_set(ir_writer& out, const tag_set& tags)
+{
+  out.u(tags.size());
+  for(string_ref t : tags)
+    out.u(t.i);
+}
+
+static void
+write_symbols(ir_writer& out, const trans_sym_t* syms, unsigned int len)
+{
+  out.u(len);
+  for(unsigned int i = 0; i < len; i++)
+    out.s((int)syms[i]);
+}
+
+static void
+write_token(ir_writer& out, const token_t& tok)
+{
+  out.u(tok.name.i);
+  out.u(tok.part);
+  out.u(tok.optional);
+}
+
+// With `tags`, transition labels are written as indices into a table
+// of symbol pairs instead of as pair ids (see saveCached()).
+static void
+write_transducer(ir_writer& out, Transducer* t, const unordered_map<int, size_t>* tags = nullptr)
+{
+  // optional() and friends move the initial state, but a fresh
+  // Transducer always starts from 0, so those two trade places
+  const int initial = t->getInitial();
+  auto state_id = [initial](int s) -> uint64_t {
+    return (uint64_t)(s == initial ? 0 : (s == 0 ? initial : s));
+  };
+  auto &transitions = t->getTransitions();
+  out.u(transitions.size());
+  for(auto &state : transitions)
+  {
+    out.u(state_id(state.first));
+    out.u(state.second.size());
+    for(auto &tr : state.second)
+    {
+      if(tags)
+        out.u(tags->at(tr.first));
+      else
+        out.s(tr.first);
+      out.u(state_id(tr.second.first));
+      out.raw((const char*)&tr.second.second, sizeof(double));
+    }
+  }
+  out.u(t->getFinals().size());
+  for(auto &fin : t->getFinals())
+  {
+    out.u(state_id(fin.first));
+    out.raw((const char*)&fin.second, sizeof(double));
+  }
+}
+
+// Payload layout, in order: line count, names, multichar symbols,
+// symbol pairs, lexicons, patterns. Everything refers to names,
+// symbols and pairs by id, so they are restored first and in id order.
+void
+LexdCompiler::writeIR(uint64_t source_hash)
+{
+  ir_writer payload;
+  payload.s(lineNumber);
+
+  payload.u(names.size());
+  for(unsigned int i = 0; i < names.size(); i++)
+    payload.str(names.name(i));
+
+  payload.u((uint64_t)alphabet.size());
+  for(int i = 1; i <= alphabet.size(); i++)
+  {
+    UString sym;
+    alphabet.getSymbol(sym, -i);
+    payload.str(UnicodeString(sym.data(), (int32_t)sym.size()));
+  }
+
+  // pair ids are dense and every pair so far was created through
+  // alphabet_lookup(), so the largest cached id is the last one
+  int pairs = 0;
+  for(auto &it : pairIds)
+    pairs = max(pairs, (int)it.second);
+  payload.u((uint64_t)pairs);
+  for(int i = 1; i <= pairs; i++)
+  {
+    payload.s(alphabet.decode(i).first);
+    payload.s(alphabet.decode(i).second);
+  }
+
+  payload.u(lexicons.size());
+  for(auto &lex : lexicons)
+  {
+    payload.u(lex.first.i);
+    payload.u(lex.second.size());
+    payload.u(lex.second.parts());
+    for(size_t i = 0; i < lex.second.size(); i++)
+    {
+      for(unsigned int part = 0; part < lex.second.parts(); part++)
+      {
+        seg_view_t seg = lex.second.segment(i, part);
+        write_symbols(payload, seg.left, seg.left_len);
+        write_symbols(payload, seg.right, seg.right_len);
+        write_tag_set(payload, *seg.tags);
+        payload.u(seg.regex != nullptr);
+        if(seg.regex != nullptr)
+          write_transducer(payload, seg.regex);
+      }
+    }
+  }
+
+  payload.u(patterns.size());
+  for(auto &pat : patterns)
+  {
+    payload.u(pat.first.i);
+    payload.u(pat.second.size());
+    for(auto &line : pat.second)
+    {
+      payload.s(line.first);
+      payload.u(line.second.size());
+      for(auto &alternatives : line.second)
+      {
+        payload.u(alternatives.size());
+        for(auto &tok : alternatives)
+        {
+          write_token(payload, tok.left);
+          write_token(payload, tok.right);
+          payload.u(tok.mode);
+          write_tag_set(payload, tok.tag_filter.pos());
+          write_tag_set(payload, tok.tag_filter.neg());
+          payload.u(tok.tag_filter.ops().size());
+          for(auto &op : tok.tag_filter.ops())
+          {
+            payload.u(op.kind == tag_op_t::Xor);
+            write_tag_set(payload, op.operands);
+          }
+        }
+      }
+    }
+  }
+
+  ir_writer header;
+  header.raw(LEXD_IR_MAGIC, strlen(LEXD_IR_MAGIC));
+  header.u(LEXD_IR_VERSION);
+  header.u(source_hash);
+  header.u(shouldCombine);
+  header.u(ir_hash(payload.bytes().data(), payload.bytes().size()));
+  header.u(payload.bytes().size());
+
+  FILE* out = fopen(irOutput.c_str(), "wb");
+  if(out == nullptr ||
+     fwrite(header.bytes().data(), 1, header.bytes().size(), out) != header.bytes().size() ||
+     fwrite(payload.bytes().data(), 1, payload.bytes().size(), out) != payload.bytes().size() ||
+     fclose(out) != 0)
+  {
+    cerr << "Error: Cannot write IR file '" << irOutput << "'." << endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void
+ir_corrupt(const string& path)
+{
+  cerr << "Error: IR file '" << path << "' is corrupt." << endl;
+  exit(EXIT_FAILURE);
+}
+
+static tag_set
+read_tag_set(ir_reader& in)
+{
+  tag_set tags;
+  for(uint64_t n = in.u(); in.good() && n > 0; n--)
+    tags.insert(string_ref((unsigned int)in.u()));
+  return tags;
+}
+
+static void
+read_token(ir_reader& in, lex_token_t& tok)
+{
+  for(uint64_t n = in.u(); in.good() && n > 0; n--)
+    tok.symbols.push_back(trans_sym_t((int)in.s()));
+}
+
+static void
+read_token(ir_reader& in, token_t& tok)
+{
+  tok.name = string_ref((unsigned int)in.u());
+  tok.part = (unsigned int)in.u();
+  tok.optional = in.u();
+}
+
+static double
+read_weight(ir_reader& in)
+{
+  double w = 0;
+  const char* p = in.pos();
+  if(in.remaining() >= sizeof(double))
+    memcpy(&w, p, sizeof(double));
+  in.raw(p, sizeof(double));
+  return w;
+}
+
+static Transducer*
+read_transducer(ir_reader& in, const vector<int>* tags = nullptr)
+{
+  Transducer* t = new Transducer();
+  uint64_t states = in.u();
+  // states are numbered densely from the initial state 0
+  for(uint64_t i = 1; in.good() && i < states; i++)
+    t->newState();
+  for(uint64_t i = 0; in.good() && i < states; i++)
+  {
+    int src = (int)in.u();
+    for(uint64_t n = in.u(); in.good() && n > 0; n--)
+    {
+      int tag;
+      if(tags)
+      {
+        const uint64_t idx = in.u();
+        if(idx < tags->size())
+          tag = (*tags)[idx];
+        else
+        {
+          tag = 0;
+          in.fail();
+        }
+      }
+      else
+        tag = (int)in.s();
+      int dest = (int)in.u();
+      double w = read_weight(in);
+      if(in.good())
+        t->linkStates(src, dest, tag, w);
+    }
+  }
+  for(uint64_t n = in.u(); in.good() && n > 0; n--)
+  {
+    int state = (int)in.u();
+    double w = read_weight(in);
+    if(in.good())
+      t->setFinal(state, w);
+  }
+  return t;
+}
+
+// Load the state left behind by readFile() from the IR file, if it was
+// made from this source. Returns false if the source has to be parsed.
+bool
+LexdCompiler::readIR(uint64_t source_hash)
+{
+  FILE* f = fopen(irInput.c_str(), "rb");
+  if(f == nullptr)
+  {
+    cerr << "WARNING: Cannot open IR file '" << irInput << "', reading source instead." << endl;
+    return false;
+  }
+  source_reader file(f);
+  fclose(f);
+  ir_reader in(file.bytes(), file.length());
+  in.raw(LEXD_IR_MAGIC, strlen(LEXD_IR_MAGIC));
+  const uint64_t version = in.u();
+  const uint64_t hash = in.u();
+  const uint64_t combine = in.u();
+  const uint64_t payload_hash = in.u();
+  const uint64_t payload_length = in.u();
+  if(!in.good() || version != LEXD_IR_VERSION || payload_length != in.remaining() ||
+     payload_hash != ir_hash(in.pos(), in.remaining()))
+  {
+    cerr << "WARNING: '" << irInput << "' is not a lexd " << LEXD_IR_VERSION << " IR file, reading source instead." << endl;
+    return false;
+  }
+  if(hash != source_hash || combine != (uint64_t)shouldCombine)
+  {
+    if(verbose)
+      cerr << "IR file '" << irInput << "' is out of date, reading source." << endl;
+    return false;
+  }
+
+  lineNumber = (line_number_t)in.s();
+
+  const uint64_t name_count = in.u();
+  for(uint64_t i = 0; in.good() && i < name_count; i++)
+  {
+    if(internName(in.str()).i != i)
+      ir_corrupt(irInput);
+  }
+
+  const uint64_t symbol_count = in.u();
+  for(uint64_t i = 1; in.good() && i <= symbol_count; i++)
+  {
+    if((int)alphabet_lookup(in.str()) != -(int)i)
+      ir_corrupt(irInput);
+  }
+
+  const uint64_t pair_count = in.u();
+  for(uint64_t i = 1; in.good() && i <= pair_count; i++)
+  {
+    trans_sym_t l((int)in.s());
+    trans_sym_t r((int)in.s());
+    if((int)alphabet_lookup(l, r) != (int)i)
+      ir_corrupt(irInput);
+  }
+
+  for(uint64_t n = in.u(); in.good() && n > 0; n--)
+  {
+    lexicon_t &lex = lexicons[string_ref((unsigned int)in.u())];
+    lex = lexicon_t();
+    uint64_t count = in.u();
+    const uint64_t parts = in.u();
+    for(; in.good() && count > 0; count--)
+    {
+      entry_t entry;
+      for(uint64_t s = parts; in.good() && s > 0; s--)
+      {
+        lex_seg_t seg;
+        read_token(in, seg.left);
+        read_token(in, seg.right);
+        seg.tags = read_tag_set(in);
+        if(in.u())
+        {
+          seg.regex = read_transducer(in);
+          regexStore.emplace_back(seg.regex);
+        }
+        entry.push_back(seg);
+      }
+      lex.add(entry);
+    }
+  }
+
+  for(uint64_t n = in.u(); in.good() && n > 0; n--)
+  {
+    auto &pat = patterns[string_ref((unsigned int)in.u())];
+    for(uint64_t l = in.u(); in.good() && l > 0; l--)
+    {
+      line_number_t line = (line_number_t)in.s();
+      pattern_line_t elements;
+      for(uint64_t e = in.u(); in.good() && e > 0; e--)
+      {
+        vector<pattern_element_t> alternatives;
+        for(uint64_t a = in.u(); in.good() && a > 0; a--)
+        {
+          pattern_element_t tok;
+          read_token(in, tok.left);
+          read_token(in, tok.right);
+          tok.mode = (RepeatMode)in.u();
+          pos_tag_filter_t pos(read_tag_set(in));
+          neg_tag_filter_t neg(read_tag_set(in));
+          vector<tag_op_t> ops;
+          for(uint64_t o = in.u(); in.good() && o > 0; o--)
+          {
+            tag_op_t op;
+            op.kind = (in.u() ? tag_op_t::Xor : tag_op_t::Or);
+            op.operands = read_tag_set(in);
+            ops.push_back(op);
+          }
+          tok.tag_filter = tag_filter_t(pos, neg, ops);
+          alternatives.push_back(tok);
+        }
+        // every position has at least one alternative
+        if(alternatives.empty())
+          in.fail();
+        elements.push_back(alternatives);
+      }
+      pat.push_back(make_pair(line, elements));
+    }
+  }
+
+  if(!in.good() || !in.at_end())
+    ir_corrupt(irInput);
+  return true;
+}
+
+#define LEXD_CACHE_MAGIC "LEXDCACHE"
+#define LEXD_CACHE_VERSION 1
+
+void
+LexdCompiler::writeCacheSymbol(ir_writer& out, trans_sym_t sym)
+{
+  if((int)sym >= 0)
+  {
+    out.u(0);
+    out.u((uint64_t)(int)sym);
+  }
+  else
+  {
+    UString text;
+    alphabet.getSymbol(text, (int)sym);
+    out.u(1);
+    out.str(UnicodeString(text.data(), (int32_t)text.size()));
+  }
+}
+
+trans_sym_t
+LexdCompiler::readCacheSymbol(ir_reader& in)
+{
+  if(in.u() == 0)
+    return trans_sym_t((int)in.u());
+  UnicodeString text = in.str();
+  if(!in.good() || text.length() < 2)
+  {
+    in.fail();
+    return trans_sym_t();
+  }
+  return alphabet_lookup(text);
+}
+
+void
+LexdCompiler::writeCacheFilter(ir_writer& out, const tag_filter_t& filter)
+{
+  out.u(filter.pos().size());
+  for(string_ref tag : filter.pos())
+    out.str(name(tag));
+  out.u(filter.neg().size());
+  for(string_ref tag : filter.neg())
+    out.str(name(tag));
+  out.u(filter.ops().size());
+  for(auto &op : filter.ops())
+  {
+    out.u(op.kind == tag_op_t::Xor);
+    out.u(op.operands.size());
+    for(string_ref tag : op.operands)
+      out.str(name(tag));
+  }
+}
+
+// Hash of a lexicon or pattern definition. Symbols and tags are hashed
+// by their text, so the hash doesn't change when unrelated parts of the
+// file shift the ids around. Patterns refer to the names they use by
+// order of appearance and include the hashes of their definitions.
+uint64_t
+LexdCompiler::definitionHash(string_ref id)
+{
+  auto known = definitionHashes.find(id);
+  if(known != definitionHashes.end())
+    return known->second;
+  // a placeholder for self-recursive patterns, which fail to build anyway
+  definitionHashes[id] = 0;
+  ir_writer out;
+  auto lex = lexicons.find(id);
+  auto pat = patterns.find(id);
+  if(lex != lexicons.end())
+  {
+    out.u('L');
+    out.u(lex->second.size());
+    for(size_t e = 0; e < lex->second.size(); e++)
+    {
+      out.u(lex->second.parts());
+      for(unsigned int part = 0; part < lex->second.parts(); part++)
+      {
+        seg_view_t seg = lex->second.segment(e, part);
+        out.u(seg.left_len);
+        for(unsigned int i = 0; i < seg.left_len; i++)
+          writeCacheSymbol(out, seg.left[i]);
+        out.u(seg.right_len);
+        for(unsigned int i = 0; i < seg.right_len; i++)
+          writeCacheSymbol(out, seg.right[i]);
+        out.u(seg.tags->size());
+        for(string_ref tag : *seg.tags)
+          out.str(name(tag));
+        out.u(seg.regex != nullptr);
+        if(seg.regex == nullptr)
+          continue;
+        for(auto &state : seg.regex->getTransitions())
+        {
+          out.u((uint64_t)state.first);
+          out.u(state.second.size());
+          for(auto &tr : state.second)
+          {
+            auto &labels = alphabet.decode(tr.first);
+            writeCacheSymbol(out, trans_sym_t(labels.first));
+            writeCacheSymbol(out, trans_sym_t(labels.second));
+            out.u((uint64_t)tr.second.first);
+            out.raw((const char*)&tr.second.second, sizeof(double));
+          }
+        }
+        out.u(seg.regex->getFinals().size());
+        for(auto &fin : seg.regex->getFinals())
+        {
+          out.u((uint64_t)fin.first);
+          out.raw((const char*)&fin.second, sizeof(double));
+        }
+      }
+    }
+  }
+  else if(pat != patterns.end())
+  {
+    out.u('P');
+    map<string_ref, unsigned int> local;
+    vector<string_ref> used;
+    auto ref = [&](string_ref n) -> unsigned int {
+      if(n.empty())
+        return 0;
+      if(n == left_sieve_name)
+        return 1;
+      if(n == right_sieve_name)
+        return 2;
+      auto it = local.emplace(n, (unsigned int)local.size() + 3);
+      if(it.second)
+        used.push_back(n);
+      return it.first->second;
+    };
+    out.u(pat->second.size());
+    for(auto &line : pat->second)
+    {
+      out.u(line.second.size());
+      for(auto &alternatives : line.second)
+      {
+        out.u(alternatives.size());
+        for(auto &tok : alternatives)
+        {
+          out.u(ref(tok.left.name));
+          out.u(tok.left.part);
+          out.u(tok.left.optional);
+          out.u(ref(tok.right.name));
+          out.u(tok.right.part);
+          out.u(tok.right.optional);
+          out.u(tok.mode);
+          writeCacheFilter(out, tok.tag_filter);
+        }
+      }
+    }
+    for(string_ref n : used)
+      out.u(definitionHash(n));
+  }
+  else
+  {
+    out.u('U');
+    out.str(name(id));
+  }
+  const uint64_t hash = ir_hash(out.bytes().data(), out.bytes().size());
+  definitionHashes[id] = hash;
+  return hash;
+}
+
+// Everything that goes into building `tok` as a sub-transducer of the
+// given kind: 'p' pattern, 'l'/'e' lexicon with or without free
+// variation, 'f'/'g' the same built for flag diacritics.
+string
+LexdCompiler::cacheKey(const pattern_element_t& tok, char kind)
+{
+  ir_writer out;
+  out.raw(LEXD_CACHE_MAGIC, strlen(LEXD_CACHE_MAGIC));
+  out.u(LEXD_CACHE_VERSION);
+  out.u((unsigned char)kind);
+  out.u(shouldAlign);
+  out.u(shouldCompress);
+  out.u(tagsAsFlags);
+  out.u(tagsAsMinFlags);
+  out.u(minimizer);
+  out.u(definitionHash(tok.left.name));
+  out.u(tok.left.part);
+  out.u(tok.left.optional);
+  out.u(definitionHash(tok.right.name));
+  out.u(tok.right.part);
+  out.u(tok.right.optional);
+  out.u(tok.left.name == tok.right.name);
+  out.u(tok.mode);
+  writeCacheFilter(out, tok.tag_filter);
+  if(kind == 'f' || kind == 'g' || tagsAsFlags || tagsAsMinFlags)
+  {
+    // flag diacritics are named after name and tag ids, so the result
+    // depends on every name in the file and the order they appear in
+    if(namesHash == 0)
+    {
+      ir_writer all;
+      for(unsigned int i = 0; i < names.size(); i++)
+        all.str(names.name(i));
+      namesHash = ir_hash(all.bytes().data(), all.bytes().size()) | 1;
+    }
+    out.u(namesHash);
+    out.u(tok.left.name.i);
+    out.u(tok.right.name.i);
+  }
+  return out.bytes();
+}
+
+string
+LexdCompiler::cachePath(const string& key)
+{
+  char file[32];
+  snprintf(file, sizeof(file), "%016llx.lexdc", (unsigned long long)ir_hash(key.data(), key.size()));
+  return cacheDir + "/" + file;
+}
+
+// File layout:
+//   "LEXDCACHE" version key-check symbols pairs transducers
+// The symbols and pairs are looked up again in the order the original
+// build first asked for them, so a cached sub-transducer gives the
+// alphabet the same ids it would have got from building it. Transitions
+// refer to the pair table rather than to pair ids.
+bool
+LexdCompiler::loadCached(const string& key, vector<Transducer*>& trans)
+{
+  if(prebuilt != nullptr)
+  {
+    const string* bytes = prebuilt->find(key);
+    if(bytes != nullptr && readCached(key, bytes->data(), bytes->size(), trans))
+      return true;
+  }
+  if(cacheDir.empty())
+    return false;
+  FILE* f = fopen(cachePath(key).c_str(), "rb");
+  if(f == nullptr)
+    return false;
+  source_reader file(f);
+  fclose(f);
+  if(!readCached(key, file.bytes(), file.length(), trans))
+    return false;
+  if(verbose)
+    cerr << "Loaded " << trans.size() << " transducer(s) from " << cachePath(key) << endl;
+  return true;
+}
+
+bool
+LexdCompiler::readCached(const string& key, const char* bytes, size_t length, vector<Transducer*>& trans)
+{
+  ir_reader in(bytes, length);
+  in.raw(LEXD_CACHE_MAGIC, strlen(LEXD_CACHE_MAGIC));
+  const uint64_t version = in.u();
+  const uint64_t check = in.u();
+  if(!in.good() || version != LEXD_CACHE_VERSION ||
+     check != ir_hash(key.data(), key.size(), 0x6c657864ULL))
+    return false;
+  for(uint64_t n = in.u(); in.good() && n > 0; n--)
+    readCacheSymbol(in);
+  vector<int> tags;
+  for(uint64_t n = in.u(); in.good() && n > 0; n--)
+  {
+    trans_sym_t l = readCacheSymbol(in);
+    trans_sym_t r = readCacheSymbol(in);
+    if(in.good())
+      tags.push_back((int)alphabet_lookup(l, r));
+  }
+  for(uint64_t n = in.u(); in.good() && n > 0; n--)
+  {
+    if(in.u() == 0)
+      trans.push_back(NULL);
+    else
+      trans.push_back(read_transducer(in, &tags));
+  }
+  if(!in.good() || !in.at_end())
+  {
+    for(Transducer* t : trans)
+      delete t;
+    trans.clear();
+    return false;
+  }
+  return true;
+}
+
+string
+LexdCompiler::encodeCached(const string& key, const cache_log_t& log, const vector<Transducer*>& trans)
+{
+  ir_writer out;
+  out.raw(LEXD_CACHE_MAGIC, strlen(LEXD_CACHE_MAGIC));
+  out.u(LEXD_CACHE_VERSION);
+  out.u(ir_hash(key.data(), key.size(), 0x6c657864ULL));
+  out.u(log.symbols.size());
+  for(trans_sym_t sym : log.symbols)
+    writeCacheSymbol(out, sym);
+  // pairs that were only inserted from transducers built earlier go
+  // after the ones this build asked for
+  unordered_map<int, size_t> tags;
+  vector<int> order;
+  for(auto &p : log.pairs)
+  {
+    const int tag = (int)alphabet_lookup(p.first, p.second);
+    if(tags.emplace(tag, order.size()).second)
+      order.push_back(tag);
+  }
+  for(Transducer* t : trans)
+  {
+    if(t == NULL)
+      continue;
+    for(auto &state : t->getTransitions())
+      for(auto &tr : state.second)
+        if(tags.emplace(tr.first, order.size()).second)
+          order.push_back(tr.first);
+  }
+  out.u(order.size());
+  for(int tag : order)
+  {
+    auto &labels = alphabet.decode(tag);
+    writeCacheSymbol(out, trans_sym_t(labels.first));
+    writeCacheSymbol(out, trans_sym_t(labels.second));
+  }
+  out.u(trans.size());
+  for(Transducer* t : trans)
+  {
+    out.u(t != NULL);
+    if(t != NULL)
+      write_transducer(out, t, &tags);
+  }
+  return out.bytes();
+}
+
+void
+LexdCompiler::saveCached(const string& key, const cache_log_t& log, const vector<Transducer*>& trans)
+{
+  // the main thread only reads what the workers built
+  const bool share = (worker && prebuilt != nullptr);
+  if(!share && cacheDir.empty())
+    return;
+  const string bytes = encodeCached(key, log, trans);
+  if(share)
+    prebuilt->add(key, bytes);
+  if(cacheDir.empty())
+    return;
+
+  // write to a temporary name first so that a concurrent or interrupted
+  // run never sees half a file
+  const string path = cachePath(key);
+  const string temp = path + "." + to_string((long)getpid()) + ".tmp";
+  mkdir(cacheDir.c_str(), 0777);
+  FILE* f = fopen(temp.c_str(), "wb");
+  bool ok = (f != nullptr);
+  if(ok)
+  {
+    ok = (fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size());
+    ok = (fclose(f) == 0) && ok;
+  }
+  if(ok)
+    ok = (rename(temp.c_str(), path.c_str()) == 0);
+  if(!ok)
+  {
+    remove(temp.c_str());
+    if(!cacheWarned)
+      cerr << "WARNING: Cannot write to cache directory '" << cacheDir << "'." << endl;
+    cacheWarned = true;
+  }
+}
+
+struct parsed_line_t {
+  entry_t entry;
+  bool has_entry = false;
+  // entries containing regexes are reparsed serially, since the
+  // regex transducers refer to the worker's alphabet
+  bool deferred = false;
+  // size of the worker's name and symbol tables after this line
+  size_t names = 0;
+  int symbols = 0;
+};
+
+struct lexicon_chunk_t {
+  size_t header;
+  size_t first, last;
+  // lines [first, first + results.size()) were parsed by the worker;
+  // anything after that (usually an error) is left to the main thread
+  vector<parsed_line_t> results;
+  unique_ptr<LexdCompiler> worker;
+  // worker name and symbol ids translated to ours, filled in line by line
+  vector<string_ref> names;
+  vector<trans_sym_t> symbols;
+};
+
+// Parse lexicon body lines with a private name table and alphabet.
+// Called on a fresh compiler owned by the chunk.
+void
+LexdCompiler::parseChunk(vector<source_line_t>& lines, lexicon_chunk_t& chunk)
+{
+  try
+  {
+    if(lines[chunk.header].escape)
+      return;
+    UnicodeString header = lines[chunk.header].text;
+    lineNumber = (line_number_t)chunk.header + 1;
+    processLine(header);
+    for(size_t i = chunk.first; i < chunk.last; i++)
+    {
+      if(lines[i].escape)
+        return;
+      lineNumber = (line_number_t)i + 1;
+      parsed_line_t result;
+      processLine(lines[i].text);
+      if(!currentLexicon.empty())
+      {
+        result.entry = std::move(currentLexicon.back());
+        currentLexicon.pop_back();
+        result.has_entry = true;
+        for(auto &seg : result.entry)
+        {
+          if(seg.regex != nullptr)
+          {
+            seg.regex = nullptr;
+            result.deferred = true;
+          }
+        }
+      }
+      result.names = names.size();
+      result.symbols = alphabet.size();
+      chunk.results.push_back(std::move(result));
+    }
+  }
+  catch(const worker_abort &)
+  {
+  }
+}
+
+// Add the entry parsed by a worker to the current lexicon. Names and
+// symbols the worker saw for the first time on this line are interned
+// here, in the order it saw them, so ids come out exactly as they would
+// from a serial parse.
+void
+LexdCompiler::mergeChunkLine(lexicon_chunk_t& chunk, size_t index, UnicodeString& line)
+{
+  parsed_line_t &result = chunk.results[index];
+  if(result.deferred)
+    processLine(line);
+  const LexdCompiler &w = *chunk.worker;
+  while(chunk.names.size() < result.names)
+    chunk.names.push_back(internName(w.name(string_ref((unsigned int)chunk.names.size()))));
+  while(chunk.symbols.size() < (size_t)result.symbols)
+  {
+    UString sym;
+    w.alphabet.getSymbol(sym, -(int)(chunk.symbols.size() + 1));
+    chunk.symbols.push_back(alphabet_lookup(UnicodeString(sym.data(), (int32_t)sym.size())));
+  }
+  if(result.deferred || !result.has_entry)
+    return;
+  auto remap_tags = [&chunk](tags_t &tags) {
+    tags_t remapped;
+    for(string_ref t : tags)
+      remapped.insert(chunk.names[(unsigned int)t]);
+    tags = remapped;
+  };
+  auto remap_symbols = [&chunk](lex_token_t &tok) {
+    for(auto &sym : tok.symbols)
+      if((int)sym < 0)
+        sym = chunk.symbols[(size_t)(-(int)sym - 1)];
+  };
+  for(auto &seg : result.entry)
+  {
+    remap_symbols(seg.left);
+    remap_symbols(seg.right);
+    remap_tags(seg.tags);
+  }
+  currentLexicon.push_back(std::move(result.entry));
+}
+
+// --jobs: read the whole file, split the LEXICON bodies into chunks and
+// parse those on worker threads, then walk the file in order as the
+// serial reader would, taking entries from the chunks where available.
+void
+LexdCompiler::readLinesParallel()
+{
+  vector<source_line_t> lines;
+  source_line_t cur;
+  while(input->readLine(cur.text, cur.escape))
+    lines.push_back(cur);
+
+  vector<lexicon_chunk_t> blocks;
+  bool inBlock = false;
+  size_t bodyLines = 0;
+  for(size_t i = 0; i <= lines.size(); i++)
+  {
+    LineKind kind = (i == lines.size() ? PatternsHeader : line_kind(lines[i].text));
+    if(kind == BodyLine)
+      continue;
+    if(inBlock && blocks.back().first < i)
+    {
+      blocks.back().last = i;
+      bodyLines += i - blocks.back().first;
+    }
+    else if(inBlock)
+      blocks.pop_back();
+    inBlock = (kind == LexiconHeader);
+    if(inBlock)
+    {
+      blocks.emplace_back();
+      blocks.back().header = i;
+      blocks.back().first = i + 1;
+    }
+  }
+
+  // split large lexicons so that each thread gets several chunks
+  const size_t chunkSize = max((size_t)64, bodyLines / (jobs * 4) + 1);
+  vector<lexicon_chunk_t> chunks;
+  for(const auto &block : blocks)
+  {
+    for(size_t first = block.first; first < block.last; first += chunkSize)
+    {
+      chunks.emplace_back();
+      chunks.back().header = block.header;
+      chunks.back().first = first;
+      chunks.back().last = min(first + chunkSize, block.last);
+    }
+  }
+
+  atomic<size_t> next(0);
+  vector<thread> threads;
+  for(unsigned int t = 0; t < jobs && t < chunks.size(); t++)
+  {
+    threads.emplace_back([&]() {
+      for(size_t c = next++; c < chunks.size(); c = next++)
+      {
+        chunks[c].worker.reset(new LexdCompiler());
+        chunks[c].worker->worker = true;
+        chunks[c].worker->shouldCombine = shouldCombine;
+        chunks[c].worker->parseChunk(lines, chunks[c]);
+      }
+    });
+  }
+  for(auto &t : threads)
+    t.join();
+
+  size_t c = 0;
+  for(size_t i = 0; i < lines.size(); i++)
+  {
+    lineNumber = (line_number_t)i + 1;
+    while(c < chunks.size() && chunks[c].last <= i)
+    {
+      chunks[c].worker.reset();
+      c++;
+    }
+    if(c < chunks.size() && i >= chunks[c].first &&
+       i - chunks[c].first < chunks[c].results.size())
+    {
+      mergeChunkLine(chunks[c], i - chunks[c].first, lines[i].text);
+      continue;
+    }
+    if(lines[i].escape) die("Trailing backslash");
+    processLine(lines[i].text);
+  }
+  doneReading = true;
+}
+
+void
+LexdCompiler::distributeTagOps(bool usingFlags)
+{
+  // | and ^ stay symbolic on lexicon references, where the filter only
+  // selects entries. A pattern reference has its filter pushed into each
+  // of its elements, a repeated reference must not mix operands between
+  // iterations, and tag flags need plain tags, so those are still
+  // expanded into one element per combination of operands.
+  // buildPatternWithFlags() keeps an element whose tags conflict with
+  // those of the reference as it was, which is only the same for the
+  // expanded copies, so with flags lexicon references are also expanded
+  // in any pattern that may be built with a filter.
+  set<string_ref> filtered;
+  for(bool changed = usingFlags; changed; )
+  {
+    changed = false;
+    for(const auto &it : patterns)
+      for(const auto &line : it.second)
+        for(const auto &alternatives : line.second)
+          for(const auto &tok : alternatives)
+            if(patterns.find(tok.left.name) != patterns.end() &&
+               (!tok.tag_filter.empty() || filtered.count(it.first)) &&
+               filtered.insert(tok.left.name).second)
+              changed = true;
+  }
+  for(auto &it : patterns)
+  {
+    const bool expand_all = tagsAsFlags || tagsAsMinFlags || filtered.count(it.first);
+    for(auto &line : it.second)
+    {
+      for(auto &alternatives : line.second)
+      {
+        vector<pattern_element_t> expanded;
+        for(const auto &tok : alternatives)
+        {
+          if(tok.tag_filter.ops().empty() ||
+             !(expand_all || (tok.mode & Repeated) ||
+               patterns.find(tok.left.name) != patterns.end()))
+          {
+            expanded.push_back(tok);
             continue;
           }
+          for(const auto &dist : distribute_tag_expressions(tok))
+            expanded.push_back(dist);
+        }
+        alternatives.swap(expanded);
+      }
+    }
+  }
+}
+
+// Resolves every name used in a pattern and checks what can be checked
+// without building anything, so that mistakes are reported before a
+// long compilation rather than somewhere in the middle of it. Also
+// fills in the line_info_t of each line and the id of each element.
+void
+LexdCompiler::analyzePatterns()
+{
+  nameKinds.assign(names.size(), NameUndefined);
+  for(const auto &it : patterns)
+    nameKinds[(unsigned int)it.first] = NamePattern;
+  for(const auto &it : lexicons)
+    nameKinds[(unsigned int)it.first] = NameLexicon;
+  // an ALIAS that nothing has been added to since holds the very same
+  // entries as the lexicon it names
+  sharedLexicons.assign(names.size(), string_ref());
+  unordered_map<const void*, string_ref> by_storage;
+  for(const auto &it : lexicons)
+  {
+    string_ref &shared = sharedLexicons[(unsigned int)it.first];
+    shared = it.first;
+    auto first = by_storage.emplace(it.second.storage(), it.first);
+    if(!first.second && lexicons.at(first.first->second).shares(it.second))
+      shared = first.first->second;
+  }
+  lineInfo.clear();
+  derivedIds.clear();
+  for(auto &it : patterns)
+  {
+    vector<line_info_t> &infos = lineInfo[it.first];
+    for(auto &line : it.second)
+    {
+      lineNumber = line.first;
+      // the positions each name appears at, without and with '?'
+      map<string_ref, pair<set<size_t>, set<size_t>>> uses;
+      for(size_t k = 0; k < line.second.size(); k++)
+      {
+        for(pattern_element_t &tok : line.second[k])
+        {
+          tok.id = elementIds.intern(tok).i;
+          for(string_ref n : {tok.left.name, tok.right.name})
+            if(n.valid())
+              (tok.optional() ? uses[n].second : uses[n].first).insert(k);
+          if(tok.left.name == left_sieve_name || tok.left.name == right_sieve_name)
+            continue;
+          if(!isLexiconToken(tok))
+            continue;
+          for(const token_t &side : {tok.left, tok.right})
+            if(side.name.valid() && side.part > lexicons.at(side.name).parts())
+              die("%S(%d) - part is out of range", err(name(side.name)), side.part);
+          if(tok.left.name.valid() && tok.right.name.valid() &&
+             lexicons.at(tok.left.name).size() != lexicons.at(tok.right.name).size())
+            die("Cannot collate %S with %S - differing numbers of entries", err(name(tok.left.name)), err(name(tok.right.name)));
+        }
+      }
+      line_info_t info;
+      info.all_free = true;
+      for(const auto &use : uses)
+      {
+        const set<size_t> &plain = use.second.first;
+        const set<size_t> &opt = use.second.second;
+        // alternatives at one position never end up in the same
+        // expansion, but those at any two positions do
+        if(!plain.empty() && !opt.empty() &&
+           (plain.size() > 1 || opt.size() > 1 || plain != opt))
+          die("Lexicon %S cannot be both optional and non-optional in a single pattern.", err(name(use.first)));
+        if(use.first == left_sieve_name || use.first == right_sieve_name)
+          continue;
+        set<size_t> positions = plain;
+        positions.insert(opt.begin(), opt.end());
+        if(positions.size() > 1)
+          info.all_free = false;
+      }
+      info.sharable = info.all_free && isSharableLine(line.second);
+      infos.push_back(info);
+    }
+  }
+}
 
-          if(i == tag_idx)
-          {
-            next_start_state = state;
-            next_start_idx = tag_idx;
-            cur.tag_filter.combine(tok.tag_filter.pos());
-          }
-          cur.tag_filter.combine(tok.tag_filter.neg());
+// Makes this (fresh) compiler a private copy of main, ready to build
+// any of its sub-transducers.
+void
+LexdCompiler::forkFrom(const LexdCompiler& main)
+{
+  worker = true;
+  shouldAlign = main.shouldAlign;
+  shouldCompress = main.shouldCompress;
+  shouldCombine = main.shouldCombine;
+  tagsAsFlags = main.tagsAsFlags;
+  tagsAsMinFlags = main.tagsAsMinFlags;
+  cacheDir = main.cacheDir;
+  minimizer = main.minimizer;
+  stageStates = main.stageStates;
+  for(unsigned int i = names.size(); i < main.names.size(); i++)
+    names.intern(main.names.name(i));
+  for(unsigned int i = symbolNames.size(); i < main.symbolNames.size(); i++)
+    symbolNames.intern(main.symbolNames.name(i));
+  symbolIds = main.symbolIds;
+  alphabet = main.alphabet;
+  pairIds = main.pairIds;
+  for(int type = 0; type <= Clear; type++)
+    flagIds[type] = main.flagIds[type];
+  lexicons = main.lexicons;
+  patterns = main.patterns;
+  lineInfo = main.lineInfo;
+  // so the ids the patterns' elements carry mean the same here
+  elementIds = main.elementIds;
+  derivedIds = main.derivedIds;
+  nameKinds = main.nameKinds;
+  sharedLexicons = main.sharedLexicons;
+  definitionHashes = main.definitionHashes;
+  namesHash = main.namesHash;
+}
 
-          int mode_state = state;
+// Drops every sub-transducer built so far, so that the next build asks
+// the alphabet for everything it uses and its cache log is complete.
+void
+LexdCompiler::forgetBuilt()
+{
+  auto drop = [](Transducer* t) { delete t; };
+  patternTransducers.clear(drop);
+  lexiconTransducers.clear(drop);
+  entryTransducers.clear([&drop](vector<Transducer*>& ts) {
+    for(Transducer* t : ts)
+      drop(t);
+  });
+  cacheLogs.clear();
+  matchedParts.clear();
+}
 
-          if(isLexiconToken(cur))
-          {
-            tags_t tags = cur.tag_filter.tags();
-            for(auto tag : tags)
-            {
-              trans_sym_t flag = getFlag(Clear, tag, 0);
-              state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
-            }
-            pattern_element_t untagged = cur;
-            untagged.tag_filter = tag_filter_t();
-            untagged.mode = Normal;
-            bool free = (lexiconFreedom[cur.left.name] && lexiconFreedom[cur.right.name]);
-            if(!free)
-            {
-              to_clear.insert(cur.left.name);
-              to_clear.insert(cur.right.name);
-            }
-            trans_sym_t inflag = getFlag(Positive, transition_flag, transitionCount);
-            trans_sym_t outflag = getFlag(Require, transition_flag, transitionCount);
-            transitionCount++;
-            if(transducerLocs.find(untagged) == transducerLocs.end())
-            {
-              state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(inflag, inflag), state);
-              Transducer* lex = getLexiconTransducerWithFlags(untagged, free);
-              int start = state;
-              state = hyperminTrans->insertTransducer(state, *lex);
-              transducerLocs[untagged] = make_pair(start, state);
-            }
-            else
-            {
-              auto loc = transducerLocs[untagged];
-              hyperminTrans->linkStates(state, loc.first, (int)alphabet_lookup(inflag, inflag));
-              state = loc.second;
-            }
-            state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(outflag, outflag), state);
-            for(auto tag : cur.tag_filter.pos())
-            {
-              trans_sym_t flag = getFlag(Require, tag, 1);
-              state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
-            }
-            for(auto tag : cur.tag_filter.neg())
-            {
-              trans_sym_t flag = getFlag(Disallow, tag, 1);
-              state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
-            }
-          }
-          else
-          {
-            state = buildPatternSingleLexicon(cur, state);
-            if(state == -1)
-            {
-              finished = false;
-              break;
-            }
-          }
+#define LEXICON_SHARD 4096
 
-          if(cur.mode & Optional)
-          {
-            hyperminTrans->linkStates(mode_state, state, 0);
-          }
-          if(cur.mode & Repeated)
+// Adds the node for a lexicon as `kind` builds it, and if it's big, the
+// nodes for its shards, which it waits for.
+size_t
+LexdCompiler::prebuildLexicon(prebuild_graph_t& graph, const pattern_element_t& tok, char kind)
+{
+  const bool plain = (kind == 'l' || kind == 'e');
+  const uint64_t id = (plain ? derivedId(elementId(tok), 's') : elementId(tok)).i;
+  auto node = graph.add((id << 8) | (unsigned char)kind, prebuild_node_t{tok, kind});
+  if(!node.second)
+    return node.first;
+  const unsigned int count = lexicons[tok.left.name.valid() ? tok.left.name : tok.right.name].size();
+  const auto shards = lexiconShards(count);
+  if(shards.size() > 1)
+  {
+    for(auto &range : shards)
+    {
+      const uint64_t key = ((uint64_t)node.first << 32) | range.first;
+      auto shard = graph.add(~key, prebuild_node_t{tok, kind, range.first, range.second});
+      graph.depend(node.first, shard.first);
+    }
+  }
+  return node.first;
+}
+
+// --jobs: build the patterns the top level refers to, and the lexicons
+// they use, ahead of the serial build. Every pattern reachable from
+// `start` through references that carry no tag filter is a node, as is
+// every lexicon those patterns use. A pattern waits for the nodes it
+// uses, so independent parts of the grammar build side by side.
+void
+LexdCompiler::prebuildPatterns(const pattern_element_t& start)
+{
+  prebuild_graph_t graph;
+  vector<size_t> todo;
+  auto refer = [&](const pattern_element_t& from, size_t parent) {
+    const auto &infos = lineInfo[from.left.name];
+    const auto &lines = patterns[from.left.name];
+    for(size_t l = 0; l < lines.size(); l++)
+    {
+      const auto &line = lines[l];
+      // which lexicons are built in free variation depends on the expansion
+      if(!infos[l].sharable)
+      {
+        for(line_expansion_t e(line.second); !e.at_end(); e.next())
+        {
+          const pattern_t& pat = *e;
+          const vector<int> is_free = determineFreedom(pat, infos[l]);
+          for(size_t i = 0; i < pat.size(); i++)
           {
-            hyperminTrans->linkStates(state, mode_state, 0);
+            const pattern_element_t& tok = pat[i];
+            if(tok.left.name == left_sieve_name || tok.left.name == right_sieve_name ||
+               !isLexiconToken(tok))
+              continue;
+            const unsigned int count = lexicons[tok.left.name.valid() ? tok.left.name : tok.right.name].size();
+            if(is_free[i] != 1 && count == 0 && !tok.optional())
+              continue;
+            size_t lex = prebuildLexicon(graph, tok, (is_free[i] == 1 ? 'l' : 'e'));
+            if(parent != graph.nodes.size())
+              graph.depend(parent, lex);
           }
         }
-        if(finished)
+      }
+      for(const auto &alternatives : line.second)
+        for(const auto &tok : alternatives)
         {
-          for(auto lex : to_clear)
+          if(tok.left.name == left_sieve_name || tok.left.name == right_sieve_name)
+            continue;
+          size_t child;
+          if(isLexiconToken(tok))
           {
-            if(lex.empty())
-            {
+            if(!infos[l].sharable)
               continue;
-            }
-            trans_sym_t flag = getFlag(Clear, lex, 0);
-            state = hyperminTrans->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
-          }
-          if(end == -1)
-          {
-            end = state;
+            child = prebuildLexicon(graph, tok, 'l');
           }
           else
           {
-            hyperminTrans->linkStates(state, end, 0);
+            auto node = graph.add((uint64_t)elementId(tok).i << 8 | 'p',
+                                  prebuild_node_t{tok, 'p'});
+            child = node.first;
+            // a filtered pattern pushes its tags into what it refers to
+            if(node.second && tok.tag_filter.empty())
+              todo.push_back(child);
           }
+          if(parent != graph.nodes.size())
+            graph.depend(parent, child);
         }
-      }
     }
-    patternTransducers.erase(tok);
-    return end;
+  };
+  // past the end of the nodes, standing for start
+  refer(start, graph.nodes.size());
+  while(!todo.empty())
+  {
+    size_t n = todo.back();
+    todo.pop_back();
+    refer(graph.nodes[n].tok, n);
   }
-  else
+  prebuild(graph);
+}
+
+// Builds the nodes of the graph on worker threads, each node once every
+// node it needs is done. Each worker builds on a private copy of the
+// compiler and passes its results on through `prebuilt` just as --cache
+// would, which lets the serial build that follows give the alphabet the
+// same ids in the same order as it would without --jobs.
+void
+LexdCompiler::prebuild(prebuild_graph_t& graph)
+{
+  if(graph.nodes.size() < 2)
+    return;
+  mutex lock;
+  condition_variable changed;
+  deque<size_t> ready;
+  size_t busy = 0;
+  for(size_t n = 0; n < graph.nodes.size(); n++)
+    if(graph.waiting[n] == 0)
+      ready.push_back(n);
+  vector<thread> threads;
+  for(unsigned int t = 0; t < jobs && t < graph.nodes.size(); t++)
   {
-    die("Cannot compile self-recursive pattern '%S'", err(name(tok.left.name)));
-    return 0;
+    threads.emplace_back([&]() {
+      LexdCompiler w;
+      w.forkFrom(*this);
+      w.prebuilt = prebuilt;
+      unique_lock<mutex> guard(lock);
+      while(true)
+      {
+        // nothing ready and nothing being built: the rest (if any)
+        // refers to itself, and is left for the serial build to report
+        changed.wait(guard, [&]() { return !ready.empty() || busy == 0; });
+        if(ready.empty())
+          break;
+        size_t n = ready.front();
+        ready.pop_front();
+        busy++;
+        guard.unlock();
+        // anything that fails is built again, and reported, serially
+        try
+        {
+          w.buildNode(graph.nodes[n]);
+        }
+        catch(const worker_abort &)
+        {
+        }
+        w.forgetBuilt();
+        guard.lock();
+        busy--;
+        for(size_t p : graph.parents[n])
+          if(--graph.waiting[p] == 0)
+            ready.push_back(p);
+        changed.notify_all();
+      }
+    });
   }
+  for(auto &t : threads)
+    t.join();
 }
 
 void
-LexdCompiler::readFile(UFILE* infile)
+LexdCompiler::buildNode(const prebuild_node_t& node)
 {
-  input = infile;
-  doneReading = false;
-  while(!u_feof(input))
+  pattern_element_t tok = node.tok;
+  const bool free = (node.kind == 'l' || node.kind == 'f');
+  if(node.kind == 'p')
   {
-    processNextLine();
-    if(doneReading) break;
+    buildPattern(tok);
+    return;
   }
-  finishLexicon();
+  if(!node.shard())
+  {
+    if(node.kind == 'l' || node.kind == 'e')
+      getLexiconTransducer(tok, 0, free);
+    else
+      getLexiconTransducerWithFlags(tok, free);
+    return;
+  }
+  const bool plain = (node.kind == 'l' || node.kind == 'e');
+  const string key = shardKey(cacheKey(plain ? sharedLexiconToken(tok) : tok, node.kind), node.begin);
+  cache_log_t log;
+  cacheLogs.push_back(&log);
+  vector<Transducer*> part;
+  if(free || !plain)
+  {
+    part.push_back(new Transducer());
+    bool did_anything = (plain ? buildLexiconEntries(tok, free, node.begin, node.end, part)
+                               : buildLexiconEntriesWithFlags(tok, free, node.begin, node.end, part[0]));
+    if(did_anything)
+      minimizeTransducer(part[0]);
+    else
+    {
+      delete part[0];
+      part[0] = NULL;
+    }
+  }
+  else
+    buildLexiconEntries(tok, free, node.begin, node.end, part);
+  cacheLogs.pop_back();
+  prebuilt->add(key, encodeCached(key, log, part));
+  for(Transducer* t : part)
+    delete t;
 }
 
 Transducer*
 LexdCompiler::buildTransducer(bool usingFlags)
 {
+  distributeTagOps(usingFlags);
+  analyzePatterns();
   token_t start_tok = {.name = internName(" "), .part = 1, .optional = false};
   pattern_element_t start_pat = {.left=start_tok, .right=start_tok,
                                  .tag_filter=tag_filter_t(),
                                  .mode=Normal};
+  if(!usingFlags && jobs > 1)
+  {
+    prebuilt_store_t store;
+    prebuilt = &store;
+    prebuildPatterns(start_pat);
+    Transducer* t = buildPattern(start_pat);
+    prebuilt = nullptr;
+    return t;
+  }
   if(usingFlags)
   {
     if(shouldHypermin)
@@ -1781,7 +3690,7 @@ LexdCompiler::buildTransducer(bool usingFlags)
     }
     Transducer *t = buildPatternWithFlags(start_pat);
     if(shouldHypermin)
-      t->minimize();
+      minimizeTransducer(t);
     return t;
   }
   else return buildPattern(start_pat);
@@ -1791,6 +3700,8 @@ Transducer*
 LexdCompiler::buildTransducerSingleLexicon()
 {
   tagsAsMinFlags = true;
+  distributeTagOps(true);
+  analyzePatterns();
   token_t start_tok = {.name = internName(" "), .part = 1, .optional = false};
   pattern_element_t start_pat = {.left=start_tok, .right=start_tok,
                                  .tag_filter=tag_filter_t(),
@@ -1804,37 +3715,26 @@ LexdCompiler::buildTransducerSingleLexicon()
   }
   else {
     hyperminTrans->setFinal(end);
-    hyperminTrans->minimize();
+    minimizeTransducer(hyperminTrans);
   }
   return hyperminTrans;
 }
 
-void expand_alternation(vector<pattern_t> &pats, const vector<pattern_element_t> &alternation)
+void add_alternation(pattern_line_t &line, const vector<pattern_element_t> &alternation)
 {
   if(alternation.empty())
     return;
-  if(pats.empty())
-    pats.push_back(pattern_t());
-  vector<pattern_t> new_pats;
-  for(const auto &pat: pats)
-  {
-    for(const auto &tok: alternation)
-    {
-      auto pat1 = pat;
-      pat1.push_back(tok);
-      new_pats.push_back(pat1);
-    }
-  }
-  pats = new_pats;
+  line.push_back(alternation);
 }
 
 void
-LexdCompiler::insertEntry(Transducer* trans, const lex_seg_t &seg)
+LexdCompiler::insertEntry(Transducer* trans, const seg_view_t &seg, acyclic_builder_t* paths)
 {
   int state = trans->getInitial();
+  vector<int> tags;
   if(tagsAsFlags)
   {
-    for(string_ref tag : seg.tags)
+    for(string_ref tag : *seg.tags)
     {
       trans_sym_t check1 = getFlag(Require, tag, 1);
       trans_sym_t check2 = getFlag(Disallow, tag, 2);
@@ -1847,109 +3747,90 @@ LexdCompiler::insertEntry(Transducer* trans, const lex_seg_t &seg)
   }
   else if(tagsAsMinFlags)
   {
-    for(string_ref tag : seg.tags)
+    for(string_ref tag : *seg.tags)
     {
       trans_sym_t flag = getFlag(Positive, tag, 1);
-      state = trans->insertSingleTransduction((int)alphabet_lookup(flag, flag), state);
+      tags.push_back((int)alphabet_lookup(flag, flag));
     }
   }
+  // an entry that's a single path can go in with the rest of them
+  if(paths != nullptr && !tagsAsFlags && seg.regex == nullptr)
+  {
+    entryPairs(seg, tags);
+    paths->add(tags);
+    return;
+  }
+  for(int tag : tags)
+    state = trans->insertSingleTransduction(tag, state);
   if (seg.regex != nullptr) {
     state = trans->insertTransducer(state, *seg.regex);
   }
+  tags.clear();
+  entryPairs(seg, tags);
+  for(int tag : tags)
+    state = trans->insertSingleTransduction(tag, state);
+  trans->setFinal(state);
+}
+
+// Appends the symbol pairs of the entry's path, aligned if need be.
+void
+LexdCompiler::entryPairs(const seg_view_t &seg, vector<int>& tags)
+{
   if(!shouldAlign)
   {
-    for(unsigned int i = 0; i < seg.left.symbols.size() || i < seg.right.symbols.size(); i++)
+    for(unsigned int i = 0; i < seg.left_len || i < seg.right_len; i++)
     {
-      trans_sym_t l = (i < seg.left.symbols.size()) ? seg.left.symbols[i] : trans_sym_t();
-      trans_sym_t r = (i < seg.right.symbols.size()) ? seg.right.symbols[i] : trans_sym_t();
-      state = trans->insertSingleTransduction(alphabet((int)l, (int)r), state);
+      trans_sym_t l = (i < seg.left_len) ? seg.left[i] : trans_sym_t();
+      trans_sym_t r = (i < seg.right_len) ? seg.right[i] : trans_sym_t();
+      tags.push_back((int)alphabet_lookup(l, r));
     }
   }
   else
   {
     /*
-      This code is adapted from hfst/libhfst/src/parsers/lexc-utils.cc
-      It uses the Levenshtein distance algorithm to determine the optimal
-      alignment of two strings.
-      In hfst-lexc, the priority order for ties is SUB > DEL > INS
-      which ensures that 000abc:xyz000 is preferred over abc000:000xyz
-      However, we're traversing the strings backwards to simplify extracting
-      the final alignment, so we need to switch INS and DEL.
-      If shouldCompress is true, we set the cost of SUB to 1 in order to prefer
-      a:b over 0:b a:0 without changing the alignment of actual correspondences.
+      This was adapted from hfst/libhfst/src/parsers/lexc-utils.cc, see
+      alignment.h. If shouldCompress is true, we set the cost of SUB to 1
+      in order to prefer a:b over 0:b a:0 without changing the alignment
+      of actual correspondences.
     */
-    const unsigned int INS = 0;
-    const unsigned int DEL = 1;
-    const unsigned int SUB = 2;
-    const unsigned int ins_cost = 1;
-    const unsigned int del_cost = 1;
-    const unsigned int sub_cost = (shouldCompress ? 1 : 100);
-
-    const unsigned int len1 = seg.left.symbols.size();
-    const unsigned int len2 = seg.right.symbols.size();
-    unsigned int cost[len1+1][len2+1];
-    unsigned int path[len1+1][len2+1];
-    cost[0][0] = 0;
-    path[0][0] = 0;
-    for(unsigned int i = 1; i <= len1; i++)
+    alignLeft.clear();
+    for(unsigned int i = 0; i < seg.left_len; i++)
+      alignLeft.push_back((int)seg.left[i]);
+    alignRight.clear();
+    for(unsigned int i = 0; i < seg.right_len; i++)
+      alignRight.push_back((int)seg.right[i]);
+    unsigned int x = 0, y = 0;
+    for(aligner_t::op_t op : aligner.align(alignLeft, alignRight, (shouldCompress ? 1 : 100)))
     {
-      cost[i][0] = del_cost * i;
-      path[i][0] = DEL;
-    }
-    for(unsigned int i = 1; i <= len2; i++)
-    {
-      cost[0][i] = ins_cost * i;
-      path[0][i] = INS;
-    }
-
-    for(unsigned int i = 1; i <= len1; i++)
-    {
-      for(unsigned int j = 1; j <= len2; j++)
-      {
-        unsigned int sub = cost[i-1][j-1] + (seg.left.symbols[len1-i] == seg.right.symbols[len2-j] ? 0 : sub_cost);
-        unsigned int ins = cost[i][j-1] + ins_cost;
-        unsigned int del = cost[i-1][j] + del_cost;
-
-        if(sub <= ins && sub <= del)
-        {
-          cost[i][j] = sub;
-          path[i][j] = SUB;
-        }
-        else if(ins <= del)
-        {
-          cost[i][j] = ins;
-          path[i][j] = INS;
-        }
-        else
-        {
-          cost[i][j] = del;
-          path[i][j] = DEL;
-        }
-      }
+      trans_sym_t l = (op == aligner_t::Ins ? trans_sym_t() : seg.left[x++]);
+      trans_sym_t r = (op == aligner_t::Del ? trans_sym_t() : seg.right[y++]);
+      tags.push_back((int)alphabet_lookup(l, r));
     }
+  }
+}
 
-    for(unsigned int x = len1, y = len2; (x > 0) || (y > 0);)
-    {
-      trans_sym_t symbol;
-      switch(path[x][y])
-      {
-        case SUB:
-          symbol = alphabet_lookup(seg.left.symbols[len1-x], seg.right.symbols[len2-y]);
-          x--;
-          y--;
-          break;
-        case INS:
-          symbol = alphabet_lookup(trans_sym_t(), seg.right.symbols[len2-y]);
-          y--;
-          break;
-        default: // DEL
-          symbol = alphabet_lookup(seg.left.symbols[len1-x], trans_sym_t());
-          x--;
-      }
-      state = trans->insertSingleTransduction((int)symbol, state);
-    }
+void
+LexdCompiler::minimizeTransducer(Transducer* trans)
+{
+  if(minimizer == MinimizeLttoolbox)
+  {
+    trans->minimize();
+    return;
   }
-  trans->setFinal(state);
+  Transducer* reference = NULL;
+  if(minimizer == MinimizeChecked)
+  {
+    reference = new Transducer(*trans);
+    reference->minimize();
+  }
+  if(!minimize_transducer(trans, (worker ? 1 : jobs)))
+    trans->minimize();
+  else if(reference != NULL && !same_automaton(trans, reference))
+  {
+    delete reference;
+    die("Internal error: the lexd minimizer and the lttoolbox minimizer disagree");
+  }
+  delete reference;
 }
 
 void
@@ -1963,36 +3844,50 @@ LexdCompiler::applyMode(Transducer* trans, RepeatMode mode)
     trans->oneOrMore();
 }
 
-Transducer*
-LexdCompiler::getLexiconTransducer(pattern_element_t tok, unsigned int entry_index, bool free)
+// Inserts entries [begin, end) of the lexicon into trans[0], or, without
+// free variation, appends a transducer for each of them. Returns whether
+// any of them passed the tag filter.
+bool
+LexdCompiler::buildLexiconEntries(const pattern_element_t& tok, bool free, unsigned int begin, unsigned int end, vector<Transducer*>& trans)
 {
-  if(!free && entryTransducers.find(tok) != entryTransducers.end())
-    return entryTransducers[tok][entry_index];
-  if(free && lexiconTransducers.find(tok) != lexiconTransducers.end())
-    return lexiconTransducers[tok];
-
-  vector<entry_t>& lents = lexicons[tok.left.name];
-  if(tok.left.name.valid() && tok.left.part > lents[0].size())
-    die("%S(%d) - part is out of range", err(name(tok.left.name)), tok.left.part);
-  vector<entry_t>& rents = lexicons[tok.right.name];
-  if(tok.right.name.valid() && tok.right.part > rents[0].size())
-    die("%S(%d) - part is out of range", err(name(tok.right.name)), tok.right.part);
-  if(tok.left.name.valid() && tok.right.name.valid() && lents.size() != rents.size())
-    die("Cannot collate %S with %S - differing numbers of entries", err(name(tok.left.name)), err(name(tok.right.name)));
-  unsigned int count = (tok.left.name.valid() ? lents.size() : rents.size());
-  vector<Transducer*> trans;
-  if(free)
-    trans.push_back(new Transducer());
-  else
-    trans.reserve(count);
-  lex_seg_t empty;
+  const lexicon_t& lents = lexicons[tok.left.name];
+  const lexicon_t& rents = lexicons[tok.right.name];
+  // When only one column contributes tags, the filter need only be
+  // checked once per distinct tag set rather than once per entry.
+  const bool one_column = tok.left.name.empty() || tok.right.name.empty() ||
+                          (tok.left.name == tok.right.name && tok.left.part == tok.right.part);
+  const lexicon_t& tagged = (tok.left.name.valid() ? lents : rents);
+  const unsigned int tagged_part = (tok.left.name.valid() ? tok.left.part : tok.right.part) - 1;
+  vector<bool> accepts;
+  if(one_column)
+  {
+    accepts.reserve(tagged.signatureCount());
+    for(size_t sig = 0; sig < tagged.signatureCount(); sig++)
+      accepts.push_back(tok.tag_filter.compatible(tagged.signature((uint32_t)sig)));
+  }
+  const seg_view_t empty;
+  tags_t tags;
+  acyclic_builder_t paths;
   bool did_anything = false;
-  for(unsigned int i = 0; i < count; i++)
+  for(unsigned int i = begin; i < end; i++)
   {
-    lex_seg_t& le = (tok.left.name.valid() ? lents[i][tok.left.part-1] : empty);
-    lex_seg_t& re = (tok.right.name.valid() ? rents[i][tok.right.part-1] : empty);
-    tags_t tags = unionset(le.tags, re.tags);
-    if(!tok.tag_filter.compatible(tags))
+    const seg_view_t le = (tok.left.name.valid() ? lents.segment(i, tok.left.part-1) : empty);
+    const seg_view_t re = (tok.right.name.valid() ? rents.segment(i, tok.right.part-1) : empty);
+    const tags_t* seg_tags;
+    if(one_column)
+    {
+      if(!accepts[tagged.tagId(i, tagged_part)])
+        seg_tags = nullptr;
+      else
+        seg_tags = (tok.left.name.valid() ? le.tags : re.tags);
+    }
+    else
+    {
+      tags = *le.tags;
+      tags.add(*re.tags);
+      seg_tags = (tok.tag_filter.compatible(tags) ? &tags : nullptr);
+    }
+    if(seg_tags == nullptr)
     {
       if(!free)
         trans.push_back(NULL);
@@ -2007,7 +3902,14 @@ LexdCompiler::getLexiconTransducer(pattern_element_t tok, unsigned int entry_ind
       if (tok.left.name != tok.right.name)
         die("Cannot collate %S with %S - %S contains a regex", err(name(tok.left.name)), err(name(tok.right.name)), err(name((le.regex != nullptr ? tok.left.name : tok.right.name))));
     }
-    insertEntry(t, {.left=le.left, .right=re.right, .regex=le.regex, .tags=tags});
+    seg_view_t seg;
+    seg.left = le.left;
+    seg.left_len = le.left_len;
+    seg.right = re.right;
+    seg.right_len = re.right_len;
+    seg.regex = le.regex;
+    seg.tags = seg_tags;
+    insertEntry(t, seg, (free ? &paths : nullptr));
     did_anything = true;
     if(!free)
     {
@@ -2015,10 +3917,68 @@ LexdCompiler::getLexiconTransducer(pattern_element_t tok, unsigned int entry_ind
       trans.push_back(t);
     }
   }
+  if(!paths.empty())
+    paths.emit(trans[0], trans[0]->getInitial());
+  return did_anything;
+}
+
+Transducer*
+LexdCompiler::getLexiconTransducer(pattern_element_t tok, unsigned int entry_index, bool free)
+{
+  const element_id_t id = derivedId(elementId(tok), 's');
+  if(!free && entryTransducers.find(id) != nullptr)
+    return (*entryTransducers.find(id))[entry_index];
+  if(free && lexiconTransducers.find(id) != nullptr)
+    return *lexiconTransducers.find(id);
+
+  string key;
+  cache_log_t log;
+  if(caching())
+  {
+    key = cacheKey(elementIds[id], free ? 'l' : 'e');
+    vector<Transducer*> cached;
+    if(loadCached(key, cached))
+    {
+      if(free)
+        return lexiconTransducers[id] = cached[0];
+      entryTransducers[id] = cached;
+      return cached[entry_index];
+    }
+    cacheLogs.push_back(&log);
+  }
+
+  lexicon_t& lents = lexicons[tok.left.name];
+  if(tok.left.name.valid() && tok.left.part > lents.parts())
+    die("%S(%d) - part is out of range", err(name(tok.left.name)), tok.left.part);
+  lexicon_t& rents = lexicons[tok.right.name];
+  if(tok.right.name.valid() && tok.right.part > rents.parts())
+    die("%S(%d) - part is out of range", err(name(tok.right.name)), tok.right.part);
+  if(tok.left.name.valid() && tok.right.name.valid() && lents.size() != rents.size())
+    die("Cannot collate %S with %S - differing numbers of entries", err(name(tok.left.name)), err(name(tok.right.name)));
+  unsigned int count = (tok.left.name.valid() ? lents.size() : rents.size());
+  vector<Transducer*> trans;
+  if(free)
+    trans.push_back(new Transducer());
+  else
+    trans.reserve(count);
+  bool did_anything = false;
+  // with --jobs, the shards of a big lexicon are built ahead of time
+  const auto shards = lexiconShards(count);
+  for(auto &range : shards)
+  {
+    vector<Transducer*> part;
+    if(shards.size() > 1 && loadShard(key, range.first, part))
+    {
+      if(mergeShard(trans, part, free))
+        did_anything = true;
+    }
+    else if(buildLexiconEntries(tok, free, range.first, range.second, trans))
+      did_anything = true;
+  }
+  const seg_view_t empty;
   if(tok.optional()) {
     Transducer* t = free ? trans[0] : new Transducer();
-    tags_t empty_tags;
-    insertEntry(t, {.left=empty.left, .right=empty.right, .regex=nullptr, .tags=empty_tags});
+    insertEntry(t, empty);
     did_anything = true;
     if (!free) {
       applyMode(t, tok.mode);
@@ -2034,17 +3994,76 @@ LexdCompiler::getLexiconTransducer(pattern_element_t tok, unsigned int entry_ind
     }
     if(trans[0])
     {
-      trans[0]->minimize();
+      minimizeTransducer(trans[0]);
       applyMode(trans[0], tok.mode);
     }
-    lexiconTransducers[tok] = trans[0];
-    return trans[0];
+    lexiconTransducers[id] = trans[0];
   }
   else
+    entryTransducers[id] = trans;
+  if(caching())
+  {
+    cacheLogs.pop_back();
+    saveCached(key, log, trans);
+  }
+  return trans[free ? 0 : entry_index];
+}
+
+// --jobs splits a lexicon of more than LEXICON_SHARD entries into runs of
+// that many, to be built side by side. The runs are contiguous so that
+// loading them in order asks the alphabet for symbols in the same order
+// building the whole lexicon would.
+vector<pair<unsigned int, unsigned int>>
+LexdCompiler::lexiconShards(unsigned int count) const
+{
+  vector<pair<unsigned int, unsigned int>> shards;
+  if(prebuilt == nullptr || count <= LEXICON_SHARD)
+    shards.push_back(make_pair(0u, count));
+  else
+    for(unsigned int begin = 0; begin < count; begin += LEXICON_SHARD)
+      shards.push_back(make_pair(begin, min(count, begin + LEXICON_SHARD)));
+  return shards;
+}
+
+string
+LexdCompiler::shardKey(const string& key, unsigned int begin) const
+{
+  ir_writer out;
+  out.raw(key.data(), key.size());
+  out.u(begin);
+  return out.bytes();
+}
+
+bool
+LexdCompiler::loadShard(const string& key, unsigned int begin, vector<Transducer*>& trans)
+{
+  const string skey = shardKey(key, begin);
+  const string* bytes = prebuilt->find(skey);
+  return bytes != nullptr && readCached(skey, bytes->data(), bytes->size(), trans);
+}
+
+// Adds a shard to the lexicon built so far: a free lexicon takes the
+// union, which is minimized along with the rest of it. Returns whether
+// the shard had anything in it.
+bool
+LexdCompiler::mergeShard(vector<Transducer*>& trans, const vector<Transducer*>& part, bool free)
+{
+  bool did_anything = false;
+  if(!free)
+  {
+    for(Transducer* t : part)
+    {
+      did_anything = did_anything || (t != NULL);
+      trans.push_back(t);
+    }
+  }
+  else if(part[0] != NULL)
   {
-    entryTransducers[tok] = trans;
-    return trans[entry_index];
+    trans[0]->setFinal(trans[0]->insertTransducer(trans[0]->getInitial(), *part[0]));
+    delete part[0];
+    did_anything = true;
   }
+  return did_anything;
 }
 
 void
@@ -2063,6 +4082,15 @@ trans_sym_t
 LexdCompiler::getFlag(FlagDiacriticType type, string_ref flag, unsigned int value)
 {
   //cerr << "getFlag(" << type << ", " << to_ustring(name(flag)) << ", " << value << ")" << endl;
+  const uint64_t key = ((uint64_t)flag.i << 32) | value;
+  auto cached = flagIds[type].find(key);
+  if(cached != flagIds[type].end())
+  {
+    for(cache_log_t* log : cacheLogs)
+      if(log->seen_symbols.insert((int)cached->second).second)
+        log->symbols.push_back(cached->second);
+    return cached->second;
+  }
   UnicodeString flagstr = "@";
   switch(type)
   {
@@ -2092,41 +4120,34 @@ LexdCompiler::getFlag(FlagDiacriticType type, string_ref flag, unsigned int valu
     encodeFlag(flagstr, (int)(value + 1));
   }
   flagstr += "@";
-  return alphabet_lookup(flagstr);
+  return flagIds[type][key] = alphabet_lookup(flagstr);
 }
 
-Transducer*
-LexdCompiler::getLexiconTransducerWithFlags(pattern_element_t& tok, bool free)
+// Inserts entries [begin, end) of the lexicon into trans, returning
+// whether any of them passed the tag filter.
+bool
+LexdCompiler::buildLexiconEntriesWithFlags(const pattern_element_t& tok, bool free, unsigned int begin, unsigned int end, Transducer* trans)
 {
-  if(!free && entryTransducers.find(tok) != entryTransducers.end())
-    return entryTransducers[tok][0];
-  if(free && lexiconTransducers.find(tok) != lexiconTransducers.end())
-    return lexiconTransducers[tok];
-
-  // TODO: can this be abstracted from here and getLexiconTransducer()?
-  vector<entry_t>& lents = lexicons[tok.left.name];
-  if(tok.left.name.valid() && tok.left.part > lents[0].size())
-    die("%S(%d) - part is out of range", err(name(tok.left.name)), tok.left.part);
-  vector<entry_t>& rents = lexicons[tok.right.name];
-  if(tok.right.name.valid() && tok.right.part > rents[0].size())
-    die("%S(%d) - part is out of range", err(name(tok.right.name)), tok.right.part);
-  if(tok.left.name.valid() && tok.right.name.valid() && lents.size() != rents.size())
-    die("Cannot collate %S with %S - differing numbers of entries", err(name(tok.left.name)), err(name(tok.right.name)));
-  unsigned int count = (tok.left.name.valid() ? lents.size() : rents.size());
-  Transducer* trans = new Transducer();
-  lex_seg_t empty;
+  const lexicon_t& lents = lexicons[tok.left.name];
+  const lexicon_t& rents = lexicons[tok.right.name];
+  const seg_view_t empty;
+  tags_t tags;
+  // scratch space for the flags followed by the entry's own symbols
+  vector<trans_sym_t> left, right;
+  acyclic_builder_t paths;
   bool did_anything = false;
-  for(unsigned int i = 0; i < count; i++)
+  for(unsigned int i = begin; i < end; i++)
   {
-    lex_seg_t& le = (tok.left.name.valid() ? lents[i][tok.left.part-1] : empty);
-    lex_seg_t& re = (tok.right.name.valid() ? rents[i][tok.right.part-1] : empty);
-    tags_t tags = unionset(le.tags, re.tags);
+    const seg_view_t le = (tok.left.name.valid() ? lents.segment(i, tok.left.part-1) : empty);
+    const seg_view_t re = (tok.right.name.valid() ? rents.segment(i, tok.right.part-1) : empty);
+    tags = *le.tags;
+    tags.add(*re.tags);
     if(!tok.tag_filter.compatible(tags))
     {
       continue;
     }
     did_anything = true;
-    lex_seg_t seg;
+    seg_view_t seg;
     if (le.regex != nullptr || re.regex != nullptr) {
       if (tok.left.name.empty())
         die("Cannot use %S one-sided - it contains a regex", err(name(tok.right.name)));
@@ -2136,46 +4157,110 @@ LexdCompiler::getLexiconTransducerWithFlags(pattern_element_t& tok, bool free)
         die("Cannot collate %S with %S - %S contains a regex", err(name(tok.left.name)), err(name(tok.right.name)), err(name((le.regex != nullptr ? tok.left.name : tok.right.name))));
       seg.regex = le.regex;
     }
+    left.clear();
+    right.clear();
     if(!free && tok.left.name.valid())
     {
       trans_sym_t flag = getFlag(Unification, tok.left.name, i);
-      seg.left.symbols.push_back(flag);
-      seg.right.symbols.push_back(flag);
+      left.push_back(flag);
+      right.push_back(flag);
     }
     if(!free && tok.right.name.valid() && tok.right.name != tok.left.name)
     {
       trans_sym_t flag = getFlag(Unification, tok.right.name, i);
-      seg.left.symbols.push_back(flag);
-      seg.right.symbols.push_back(flag);
+      left.push_back(flag);
+      right.push_back(flag);
     }
-    if(tok.left.name.valid())
+    left.insert(left.end(), le.left, le.left + le.left_len);
+    right.insert(right.end(), re.right, re.right + re.right_len);
+    seg.left = left.data();
+    seg.left_len = (unsigned int)left.size();
+    seg.right = right.data();
+    seg.right_len = (unsigned int)right.size();
+    seg.tags = &tags;
+    insertEntry(trans, seg, &paths);
+  }
+  if(!paths.empty())
+    paths.emit(trans, trans->getInitial());
+  return did_anything;
+}
+
+Transducer*
+LexdCompiler::getLexiconTransducerWithFlags(pattern_element_t& tok, bool free)
+{
+  const element_id_t id = elementId(tok);
+  if(!free && entryTransducers.find(id) != nullptr)
+    return (*entryTransducers.find(id))[0];
+  if(free && lexiconTransducers.find(id) != nullptr)
+    return *lexiconTransducers.find(id);
+
+  string key;
+  cache_log_t log;
+  if(caching())
+  {
+    key = cacheKey(tok, free ? 'f' : 'g');
+    vector<Transducer*> cached;
+    if(loadCached(key, cached))
     {
-      seg.left.symbols.insert(seg.left.symbols.end(), le.left.symbols.begin(), le.left.symbols.end());
+      if(free)
+        lexiconTransducers[id] = cached[0];
+      else
+        entryTransducers[id] = cached;
+      return cached[0];
     }
-    if(tok.right.name.valid())
+    cacheLogs.push_back(&log);
+  }
+
+  // TODO: can this be abstracted from here and getLexiconTransducer()?
+  lexicon_t& lents = lexicons[tok.left.name];
+  if(tok.left.name.valid() && tok.left.part > lents.parts())
+    die("%S(%d) - part is out of range", err(name(tok.left.name)), tok.left.part);
+  lexicon_t& rents = lexicons[tok.right.name];
+  if(tok.right.name.valid() && tok.right.part > rents.parts())
+    die("%S(%d) - part is out of range", err(name(tok.right.name)), tok.right.part);
+  if(tok.left.name.valid() && tok.right.name.valid() && lents.size() != rents.size())
+    die("Cannot collate %S with %S - differing numbers of entries", err(name(tok.left.name)), err(name(tok.right.name)));
+  unsigned int count = (tok.left.name.valid() ? lents.size() : rents.size());
+  Transducer* trans = new Transducer();
+  bool did_anything = false;
+  const auto shards = lexiconShards(count);
+  for(auto &range : shards)
+  {
+    vector<Transducer*> part;
+    if(shards.size() > 1 && loadShard(key, range.first, part))
     {
-      seg.right.symbols.insert(seg.right.symbols.end(), re.right.symbols.begin(), re.right.symbols.end());
+      vector<Transducer*> whole(1, trans);
+      if(mergeShard(whole, part, true))
+        did_anything = true;
     }
-    seg.tags.insert(tags.begin(), tags.end());
-    insertEntry(trans, seg);
+    else if(buildLexiconEntriesWithFlags(tok, free, range.first, range.second, trans))
+      did_anything = true;
   }
+  // scratch space for the flags followed by the entry's own symbols
+  vector<trans_sym_t> left, right;
   if(tok.optional()) {
-    lex_seg_t seg;
+    left.clear();
+    right.clear();
     if (!free && tok.left.name.valid()) {
       trans_sym_t flag = getFlag(Unification, tok.left.name, count);
-      seg.left.symbols.push_back(flag);
-      seg.right.symbols.push_back(flag);
+      left.push_back(flag);
+      right.push_back(flag);
     }
     if (!free && tok.right.name.valid() && tok.right.name != tok.left.name) {
       trans_sym_t flag = getFlag(Unification, tok.right.name, count);
-      seg.left.symbols.push_back(flag);
-      seg.right.symbols.push_back(flag);
+      left.push_back(flag);
+      right.push_back(flag);
     }
+    seg_view_t seg;
+    seg.left = left.data();
+    seg.left_len = (unsigned int)left.size();
+    seg.right = right.data();
+    seg.right_len = (unsigned int)right.size();
     insertEntry(trans, seg);
   }
   if(did_anything)
   {
-    trans->minimize();
+    minimizeTransducer(trans);
     applyMode(trans, tok.mode);
   }
   else
@@ -2184,11 +4269,16 @@ LexdCompiler::getLexiconTransducerWithFlags(pattern_element_t& tok, bool free)
   }
   if(free)
   {
-    lexiconTransducers[tok] = trans;
+    lexiconTransducers[id] = trans;
   }
   else
   {
-    entryTransducers[tok] = vector<Transducer*>(1, trans);
+    entryTransducers[id] = vector<Transducer*>(1, trans);
+  }
+  if(caching())
+  {
+    cacheLogs.pop_back();
+    saveCached(key, log, vector<Transducer*>(1, trans));
   }
   return trans;
 }
@@ -2206,7 +4296,21 @@ LexdCompiler::printStatistics() const
   cerr << "Patterns: " << patterns.size() << endl;
   cerr << "Pattern entries: ";
   for(const auto &pair: patterns)
-    x += pair.second.size();
+  {
+    // counted as expanded, one per combination of alternatives
+    for(const auto &line: pair.second)
+    {
+      unsigned int expansions = 1;
+      for(const auto &alternatives: line.second)
+      {
+        unsigned int n = 0;
+        for(const auto &tok: alternatives)
+          n += (tok.tag_filter.ops().empty() ? 1 : (unsigned int)tok.tag_filter.distribute().size());
+        expansions *= n;
+      }
+      x += expansions;
+    }
+  }
   cerr << x << endl;
   cerr << endl;
   cerr << "Counts for individual lexicons:" << endl;
@@ -1,7 +1,16 @@
 #ifndef __LEXDCOMPILER__
 #define __LEXDCOMPILER__
 
+#include "acyclic-builder.h"
+#include "alignment.h"
 #include "icu-iter.h"
+#include "lexer.h"
+#include "intern-table.h"
+#include "name-table.h"
+#include "ir.h"
+#include "source-reader.h"
+#include "string-ref.h"
+#include "tag-set.h"
 
 #include <lttoolbox/transducer.h>
 #include <lttoolbox/alphabet.h>
@@ -9,41 +18,20 @@
 #include <unicode/unistr.h>
 
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <fstream>
 #include <iostream>
 #include <vector>
 #include <set>
 #include <memory>
+#include <mutex>
 #include <cstdarg>
 
 using namespace std;
 using namespace icu;
 
-struct string_ref {
-  unsigned int i;
-  string_ref() : i(0) {}
-  explicit string_ref(unsigned int _i) : i(_i) {}
-  explicit operator unsigned int() const { return i; }
-  bool operator == (string_ref other) const { return i == other.i; }
-  bool operator != (string_ref other) const { return !(*this == other); }
-  bool operator < (string_ref other) const { return i < other.i; }
-  bool operator !() const { return empty(); }
-  string_ref operator || (string_ref other) const {
-    return i ? *this : other;
-  }
-  bool empty() const { return i == 0; }
-  bool valid() const { return i != 0; }
-};
-
-template<>
-struct std::hash<string_ref> {
-  size_t operator()(const string_ref &t) const
-  {
-    return std::hash<unsigned int>()(t.i);
-  }
-};
-
 template<typename T>
 bool subset(const set<T> &xs, const set<T> &ys)
 {
@@ -105,41 +93,49 @@ void subtractset_inplace(set<T> &xs, const set<T> &ys)
 
 struct lex_token_t;
 
-class tags_t : public set<string_ref>
+class tags_t : public tag_set
 {
-  using set<string_ref>::set;
+  using tag_set::tag_set;
   public:
-  tags_t(const set<string_ref> &s) : set(s) { }
+  tags_t(const tag_set &s) : tag_set(s) { }
 };
-class pos_tag_filter_t : public set<string_ref>
+class pos_tag_filter_t : public tag_set
 {
-  using set<string_ref>::set;
+  using tag_set::tag_set;
   public:
-  pos_tag_filter_t(const set<string_ref> &s) : set(s) { }
+  pos_tag_filter_t(const tag_set &s) : tag_set(s) { }
 };
-class neg_tag_filter_t : public set<string_ref>
+class neg_tag_filter_t : public tag_set
 {
-  using set<string_ref>::set;
+  using tag_set::tag_set;
   public:
-  neg_tag_filter_t(const set<string_ref> &s) : set(s) { }
+  neg_tag_filter_t(const tag_set &s) : tag_set(s) { }
 };
 
-class tag_filter_t;
-class op_tag_filter_t : public set<string_ref>
-{
-  using set<string_ref>::set;
-  public:
-  op_tag_filter_t(const set<string_ref> &s) : set(s) { }
-  virtual std::vector<tag_filter_t> distribute(const tag_filter_t &tags) const = 0;
-  UChar sigil = '?';
+// an | or ^ group in a tag filter: [|[a,b]] asks for at least one of
+// the operands, [^[a,b]] for exactly one
+struct tag_op_t {
+  enum kind_t { Or, Xor };
+  kind_t kind;
+  tag_set operands;
+  UChar sigil() const { return kind == Xor ? '^' : '|'; }
+  bool operator<(const tag_op_t &o) const
+  {
+    return kind < o.kind || (kind == o.kind && operands < o.operands);
+  }
+  bool operator==(const tag_op_t &o) const
+  {
+    return kind == o.kind && operands == o.operands;
+  }
+  size_t hash() const { return operands.hash() * 31 + (size_t)kind; }
 };
 struct tag_filter_t {
   tag_filter_t() = default;
-  tag_filter_t(const pos_tag_filter_t &pos, const neg_tag_filter_t &neg, const vector<shared_ptr<op_tag_filter_t>> &ops) : _pos(pos), _neg(neg), _ops(ops) { }
+  tag_filter_t(const pos_tag_filter_t &pos, const neg_tag_filter_t &neg, const vector<tag_op_t> &ops) : _pos(pos), _neg(neg), _ops(ops) { }
   tag_filter_t(const pos_tag_filter_t &pos, const neg_tag_filter_t &neg) : _pos(pos), _neg(neg) { }
   tag_filter_t(const pos_tag_filter_t &pos) : _pos(pos) {}
   tag_filter_t(const neg_tag_filter_t &neg) : _neg(neg) {}
-  tag_filter_t(const vector<shared_ptr<op_tag_filter_t>> &ops) : _ops(ops) {}
+  tag_filter_t(const vector<tag_op_t> &ops) : _ops(ops) {}
   bool empty() const { return pos().empty() && neg().empty() && ops().empty(); }
   bool operator<(const tag_filter_t &t) const
   {
@@ -149,82 +145,37 @@ struct tag_filter_t {
   {
     return _pos == t._pos && _neg == t._neg && _ops == t._ops;
   }
+  size_t hash() const
+  {
+    size_t h = _pos.hash() * 31 + _neg.hash();
+    for(const auto &op : _ops)
+      h = h * 31 + op.hash();
+    return h;
+  }
   bool compatible(const tags_t &tags) const;
   bool combinable(const tag_filter_t &other) const;
   bool applicable(const tags_t &tags) const;
   bool try_apply(tags_t &tags) const;
   const pos_tag_filter_t &pos() const { return _pos; }
   const neg_tag_filter_t &neg() const { return _neg; }
-  const vector<shared_ptr<op_tag_filter_t>> &ops() const { return _ops; }
-  const tags_t tags() { return unionset(tags_t(_pos), tags_t(_neg)); }
+  const vector<tag_op_t> &ops() const { return _ops; }
+  const tags_t tags() { tags_t t(_pos); t.add(_neg); return t; }
 
   bool combine(const tag_filter_t &other);
-
-  vector<tag_filter_t> distribute() const
-  {
-    vector<tag_filter_t> filters = { tag_filter_t(_pos, _neg) };
-    for (auto op : ops())
-    {
-      vector<tag_filter_t> next_filters;
-      for (auto &f : filters)
-        for (auto &nf : op->distribute(f))
-          next_filters.push_back(nf);
-      filters = next_filters;
-    }
-    return filters;
-  }
+  // the filters without operations that together match what this one
+  // does, one per combination of operands
+  vector<tag_filter_t> distribute() const;
 
   private:
   pos_tag_filter_t _pos;
   neg_tag_filter_t _neg;
-  vector<shared_ptr<op_tag_filter_t>> _ops;
+  vector<tag_op_t> _ops;
 };
-class or_tag_filter_t : public op_tag_filter_t
-{
-  using op_tag_filter_t::op_tag_filter_t;
-  public:
-  or_tag_filter_t(const set<string_ref> &s) : op_tag_filter_t(s) { }
-  virtual std::vector<tag_filter_t> distribute(const tag_filter_t &tags) const {
-    std::vector<tag_filter_t> res;
-    for (auto &tag : *this)
-    {
-      tag_filter_t tags_ = tags;
-      if(!tags_.combine(tag_filter_t(pos_tag_filter_t { tag })))
-        continue;
-      res.push_back(tags_);
-    }
-    return res;
-  }
-  UChar sigil = '|';
-};
-class xor_tag_filter_t : public op_tag_filter_t
-{
-  using op_tag_filter_t::op_tag_filter_t;
-  public:
-  xor_tag_filter_t(const set<string_ref> &s) : op_tag_filter_t(s) { }
-  virtual std::vector<tag_filter_t> distribute(const tag_filter_t &tags) const {
-    std::vector<tag_filter_t> res;
-    for (auto &tag : *this)
-    {
-      tag_filter_t tags_ = tags;
-      if(!tags_.combine(tag_filter_t(pos_tag_filter_t { tag })))
-        continue;
-      neg_tag_filter_t neg(*this);
-      subtractset_inplace(neg, { tag });
-      if(!tags_.combine(tag_filter_t(neg)))
-        continue;
-      res.push_back(tags_);
-    }
-    return res;
-  }
-  UChar sigil = '^';
-};
-
 
 struct token_t {
   string_ref name;
-  unsigned int part;
-  bool optional;
+  unsigned int part = 1;
+  bool optional = false;
   bool operator<(const token_t &t) const
   {
     return name < t.name || (name == t.name && part < t.part) || (name == t.name && part == t.part && optional < t.optional) ;
@@ -249,8 +200,39 @@ struct trans_sym_t {
 
 struct lex_token_t {
   vector<trans_sym_t> symbols;
-  tags_t tags;
-  bool operator ==(const lex_token_t &other) const { return symbols == other.symbols && tags == other.tags; }
+  bool operator ==(const lex_token_t &other) const { return symbols == other.symbols; }
+};
+
+// The alternatives at one position of a regex run: the contents of a
+// bracket, or a single symbol. A range of characters is kept as one
+// item rather than spelled out, and the compiler numbers the distinct
+// classes, so each is stored and expanded once however often it's used.
+struct regex_class_t {
+  struct item_t {
+    // the characters first..last if `range`, otherwise `symbols`
+    bool range = false;
+    int first = 0, last = 0;
+    vector<trans_sym_t> symbols;
+  };
+  vector<item_t> items;
+  // the identity pair of each alternative, filled in the first time the
+  // class is built; alternative k is pairs[ends[k-1], ends[k])
+  bool expanded = false;
+  vector<int> pairs;
+  vector<unsigned int> ends;
+};
+
+// A regex from a lexicon entry, as parsed. A node is either a run of
+// symbols, given as a list of columns on each side (ids of classes in
+// LexdCompiler::regexClasses), or a parenthesized group, given as its
+// options separated by |, each a list of nodes.
+struct regex_t {
+  vector<unsigned int> left, right;
+  // the run had no colon, so each symbol maps to itself
+  bool identity = true;
+  vector<vector<regex_t>> options;
+  // ?, * or + after a group
+  UChar quantifier = 0;
 };
 
 struct lex_seg_t {
@@ -278,6 +260,9 @@ struct pattern_element_t {
   token_t left, right;
   tag_filter_t tag_filter;
   RepeatMode mode;
+  // the element's id in LexdCompiler::elementIds, set for the elements
+  // of every line by analyzePatterns(); see LexdCompiler::elementId()
+  uint32_t id = UINT32_MAX;
 
   bool operator<(const pattern_element_t& o) const
   {
@@ -299,10 +284,241 @@ struct pattern_element_t {
 
 };
 
+template<>
+struct std::hash<pattern_element_t> {
+  size_t operator()(const pattern_element_t &t) const
+  {
+    size_t h = t.tag_filter.hash();
+    h = h * 31 + t.left.name.i;
+    h = h * 31 + t.left.part * 2 + t.left.optional;
+    h = h * 31 + t.right.name.i;
+    h = h * 31 + t.right.part * 2 + t.right.optional;
+    return h * 31 + (size_t)t.mode;
+  }
+};
+
+typedef intern_table<pattern_element_t> element_table;
+typedef element_table::id_t element_id_t;
+
 typedef vector<pattern_element_t> pattern_t;
+// A pattern line as written: one set of alternatives per position. It
+// stands for every pattern_t that picks one element from each set.
+typedef vector<vector<pattern_element_t>> pattern_line_t;
+
+// Steps through the pattern_t's a line stands for one at a time, with
+// the last set varying fastest.
+class line_expansion_t
+{
+  private:
+    const pattern_line_t &line;
+    vector<unsigned int> choice;
+    pattern_t pat;
+    bool done = false;
+  public:
+    line_expansion_t(const pattern_line_t &line)
+      : line(line), choice(line.size(), 0)
+    {
+      for(const auto &alternatives : line)
+        pat.push_back(alternatives[0]);
+    }
+    bool at_end() const { return done; }
+    pattern_t &operator*() { return pat; }
+    void next()
+    {
+      for(size_t k = line.size(); k > 0; k--)
+      {
+        if(++choice[k-1] < line[k-1].size())
+        {
+          pat[k-1] = line[k-1][choice[k-1]];
+          return;
+        }
+        choice[k-1] = 0;
+        pat[k-1] = line[k-1][0];
+      }
+      done = true;
+    }
+};
 typedef vector<lex_seg_t> entry_t;
 typedef int line_number_t;
 
+// What analyzePatterns() works out about a pattern line before anything
+// is built, so it needn't be redone each time the line is visited.
+struct line_info_t {
+  // no name appears at two positions, so every lexicon in every
+  // expansion of the line is free
+  bool all_free = false;
+  // the line can be built by buildPatternLine(), see isSharableLine()
+  bool sharable = false;
+};
+
+// The suffixes of one expansion of a pattern line that buildPattern() has
+// built, so that an entry of a collated lexicon which isn't used again
+// doesn't get a copy of the rest of the line all to itself.
+struct suffix_memo_t {
+  // for each position, the collated names from there on
+  vector<vector<string_ref>> live;
+  // (position, entry chosen for each live name) => start of the suffix
+  map<pair<unsigned int, vector<unsigned int>>, int> states;
+};
+
+// One segment of a lexicon entry, pointing into a lexicon_t or into
+// scratch space owned by the caller.
+struct seg_view_t {
+  static const tags_t no_tags;
+  const trans_sym_t *left = nullptr;
+  unsigned int left_len = 0;
+  const trans_sym_t *right = nullptr;
+  unsigned int right_len = 0;
+  Transducer* regex = nullptr;
+  const tags_t *tags = &no_tags;
+};
+
+// A lexicon stored by column rather than as a vector of entries. The
+// entries are held in chunks, one per LEXICON block: the symbols of
+// every segment in a chunk share one pool, and each segment is a pair
+// of offsets into it plus the id of its tag set. Chunks are shared
+// between copies of a lexicon and only written to while nothing else
+// holds them, so ALIAS copies no entries and adding a block doesn't
+// touch the earlier ones. Distinct tag sets are numbered once per
+// lexicon. Regexes are rare and live in a side table. Entries are
+// parts() segments each, stored one after the other.
+class lexicon_t
+{
+  private:
+    // distinct tag sets, numbered in order of first appearance
+    struct tag_table_t {
+      vector<tags_t> signatures;
+      unordered_map<size_t, vector<uint32_t>> index;
+
+      uint32_t intern(const tags_t &tags);
+    };
+    struct chunk_t {
+      vector<trans_sym_t> pool;
+      // segment k has pool[offsets[2k], offsets[2k+1]) on the left
+      // and pool[offsets[2k+1], offsets[2k+2]) on the right
+      vector<uint32_t> offsets = vector<uint32_t>(1, 0);
+      // numbered within the chunk
+      vector<uint32_t> tag_ids;
+      tag_table_t tags;
+      unordered_map<size_t, Transducer*> regexes;
+
+      void add(const entry_t &entry);
+    };
+    struct chunk_ref_t {
+      shared_ptr<chunk_t> chunk;
+      // the lexicon's number for each of the chunk's tag sets
+      vector<uint32_t> tag_ids;
+      // segments in this chunk and those stored before it
+      size_t end;
+    };
+    unsigned int _parts = 0;
+    // the block added last comes first in the lexicon, but is stored
+    // last so that adding it is cheap
+    vector<chunk_ref_t> chunks;
+    tag_table_t tags;
+
+    void mapTags(chunk_ref_t &ref, size_t from);
+    size_t segments() const { return chunks.empty() ? 0 : chunks.back().end; }
+    // the chunk holding segment k, with k made relative to it
+    const chunk_ref_t &locate(size_t &k) const;
+  public:
+    unsigned int parts() const { return _parts; }
+    size_t size() const { return _parts ? segments() / _parts : 0; }
+    // adds an entry after the others
+    void add(const entry_t &entry);
+    // puts the entries of other in front of these, sharing its chunks
+    void prepend(const lexicon_t &other);
+    // true if both lexicons hold the same entries in the same storage
+    bool shares(const lexicon_t &other) const;
+    const void *storage() const { return chunks.empty() ? nullptr : chunks.back().chunk.get(); }
+    // part counts from 0
+    seg_view_t segment(size_t entry, unsigned int part) const;
+    uint32_t tagId(size_t entry, unsigned int part) const
+    {
+      size_t k = entry * _parts + part;
+      const chunk_ref_t &ref = locate(k);
+      return ref.tag_ids[ref.chunk->tag_ids[k]];
+    }
+    const tags_t &signature(uint32_t id) const { return tags.signatures[id]; }
+    size_t signatureCount() const { return tags.signatures.size(); }
+};
+
+struct source_line_t {
+  UnicodeString text;
+  bool escape = false;
+};
+// a run of LEXICON body lines handed to a worker thread by --jobs
+struct lexicon_chunk_t;
+
+// The symbols and symbol pairs asked for while building one
+// sub-transducer for --cache, in the order they were first asked for.
+struct cache_log_t {
+  vector<trans_sym_t> symbols;
+  vector<pair<trans_sym_t, trans_sym_t>> pairs;
+  unordered_set<int> seen_symbols;
+  unordered_set<uint64_t> seen_pairs;
+};
+
+// --jobs: sub-transducers built by worker threads ahead of the serial
+// build, kept in the same form as --cache files and under the same keys
+class prebuilt_store_t
+{
+  private:
+    mutex lock;
+    unordered_map<string, string> files;
+  public:
+    // the bytes stay put until the store goes away
+    const string* find(const string& key)
+    {
+      lock_guard<mutex> guard(lock);
+      auto it = files.find(key);
+      return (it == files.end() ? nullptr : &it->second);
+    }
+    void add(const string& key, const string& bytes)
+    {
+      lock_guard<mutex> guard(lock);
+      files.emplace(key, bytes);
+    }
+};
+
+// --jobs: one sub-transducer to build ahead of time. `kind` is as for
+// cacheKey; a big lexicon is also split into shards of entries
+// [begin, end), each of them a node of its own.
+struct prebuild_node_t {
+  pattern_element_t tok;
+  char kind;
+  unsigned int begin = 0;
+  unsigned int end = 0;
+  bool shard() const { return end != 0; }
+};
+
+// the nodes for --jobs, and which of them wait for which
+struct prebuild_graph_t {
+  vector<prebuild_node_t> nodes;
+  // the nodes that need each node, and how many of the nodes each one
+  // needs aren't done yet
+  vector<vector<size_t>> parents;
+  vector<size_t> waiting;
+  unordered_map<uint64_t, size_t> index;
+  // returns the node's index, and whether it's new
+  pair<size_t, bool> add(uint64_t key, const prebuild_node_t& node)
+  {
+    auto it = index.emplace(key, nodes.size());
+    if(it.second)
+    {
+      nodes.push_back(node);
+      parents.emplace_back();
+      waiting.push_back(0);
+    }
+    return make_pair(it.first->second, it.second);
+  }
+  void depend(size_t parent, size_t child)
+  {
+    parents[child].push_back(parent);
+    waiting[parent]++;
+  }
+};
+
 enum FlagDiacriticType
 {
   Unification,
@@ -313,6 +529,14 @@ enum FlagDiacriticType
   Clear
 };
 
+enum MinimizerType
+{
+  MinimizeLttoolbox,
+  MinimizeLexd,
+  // lexd's, checking the result against lttoolbox's
+  MinimizeChecked
+};
+
 class LexdCompiler
 {
 private:
@@ -323,23 +547,53 @@ private:
   bool shouldHypermin = false;
   bool tagsAsMinFlags = false;
   bool verbose = false;
-
-  map<UnicodeString, string_ref> name_to_id;
-  vector<UnicodeString> id_to_name;
-
-  const UnicodeString &name(string_ref r) const;
-
-  map<string_ref, vector<entry_t>> lexicons;
+  unsigned int jobs = 1;
+  MinimizerType minimizer = MinimizeLttoolbox;
+  // named patterns are minimized whenever they grow past this many states
+  size_t stageStates = 1000000;
+  string irInput;
+  string irOutput;
+  string cacheDir;
+  // set on the private compilers that parse lexicon chunks for --jobs:
+  // errors are thrown back to the caller instead of being reported
+  bool worker = false;
+
+  name_table names;
+
+  UnicodeString name(string_ref r) const;
+
+  map<string_ref, lexicon_t> lexicons;
   // { id => [ ( line, [ pattern ] ) ] }
-  map<string_ref, vector<pair<line_number_t, pattern_t>>> patterns;
-  map<pattern_element_t, Transducer*> patternTransducers;
-  map<pattern_element_t, Transducer*> lexiconTransducers;
-  map<pattern_element_t, vector<Transducer*>> entryTransducers;
+  map<string_ref, vector<pair<line_number_t, pattern_line_t>>> patterns;
+  // lineInfo[id][i] goes with patterns[id][i], see analyzePatterns()
+  map<string_ref, vector<line_info_t>> lineInfo;
+  // what each name was defined as, indexed by name id
+  enum name_kind_t { NameUndefined, NameLexicon, NamePattern };
+  vector<name_kind_t> nameKinds;
+  // for each lexicon, the first one with the same storage, see
+  // sharedLexiconToken()
+  vector<string_ref> sharedLexicons;
+  // the memo tables below are indexed by elementId(tok)
+  element_table elementIds;
+  // (id << 8 | kind) => derivedId(id, kind)
+  unordered_map<uint64_t, element_id_t> derivedIds;
+  id_map<Transducer*> patternTransducers;
+  id_map<Transducer*> lexiconTransducers;
+  id_map<vector<Transducer*>> entryTransducers;
   map<string_ref, set<string_ref>> flagsUsed;
-  map<pattern_element_t, pair<int, int>> transducerLocs;
+  id_map<pair<int, int>> transducerLocs;
   map<string_ref, bool> lexiconFreedom;
-
-  UFILE* input = nullptr;
+  // lexicon regexes, each compiled once and shared by every entry that
+  // uses it, keyed by regexKey() of the parsed regex
+  unordered_map<string, Transducer*> regexCache;
+  vector<unique_ptr<Transducer>> regexStore;
+  vector<regex_class_t> regexClasses;
+  unordered_map<string, unsigned int> regexClassIds;
+  // for -a and -c, see entryPairs()
+  aligner_t aligner;
+  vector<int> alignLeft, alignRight;
+
+  source_reader* input = nullptr;
   bool inLex = false;
   bool inPat = false;
   vector<entry_t> currentLexicon;
@@ -365,37 +619,99 @@ private:
   void finishLexicon();
   string_ref internName(const UnicodeString& name);
   string_ref checkName(UnicodeString& name);
-  RepeatMode readModifier(char_iter& iter);
-  tag_filter_t readTagFilter(char_iter& iter, UnicodeString& line);
-  tags_t readTags(char_iter& iter, UnicodeString& line);
+  RepeatMode readModifier(token_iter& iter);
+  tag_filter_t readTagFilter(token_iter& iter, UnicodeString& line);
+  tags_t readTags(token_iter& iter, UnicodeString& line);
   void appendSymbol(const UnicodeString& s, lex_token_t& tok);
-  void readSymbol(char_iter& iter, UnicodeString& line, lex_token_t& tok);
-  int processRegexTokenSeq(char_iter& iter, UnicodeString& line, Transducer* trans, int start_state);
-  int processRegexGroup(char_iter& iter, UnicodeString& line, Transducer* trans, int start_state, unsigned int depth);
-  lex_seg_t processLexiconSegment(char_iter& iter, UnicodeString& line, unsigned int part_count);
-  token_t readToken(char_iter& iter, UnicodeString& line);
-  pattern_element_t readPatternElement(char_iter& iter, UnicodeString& line);
-  void processPattern(char_iter& iter, UnicodeString& line);
+  void readSymbol(token_iter& iter, UnicodeString& line, lex_token_t& tok);
+  void parseRegexRun(token_iter& iter, UnicodeString& line, regex_t& run);
+  void parseRegexGroup(token_iter& iter, UnicodeString& line, regex_t& group, unsigned int depth);
+  unsigned int internRegexClass(regex_class_t& cls);
+  const regex_class_t& expandRegexClass(unsigned int id);
+  int buildRegexRun(const regex_t& run, Transducer* trans, int start_state);
+  int buildRegexGroup(const regex_t& group, Transducer* trans, int start_state);
+  Transducer* processRegex(token_iter& iter, UnicodeString& line);
+  lex_seg_t processLexiconSegment(token_iter& iter, UnicodeString& line, unsigned int part_count);
+  token_t readToken(token_iter& iter, UnicodeString& line);
+  pattern_element_t readPatternElement(token_iter& iter, UnicodeString& line);
+  void processPattern(token_iter& iter, UnicodeString& line);
   void processNextLine();
-
+  void processLine(UnicodeString& line);
+  void readLinesParallel();
+  void parseChunk(vector<source_line_t>& lines, lexicon_chunk_t& chunk);
+  void mergeChunkLine(lexicon_chunk_t& chunk, size_t index, UnicodeString& line);
+  void writeIR(uint64_t source_hash);
+  bool readIR(uint64_t source_hash);
+
+  // --cache: built sub-transducers are stored under a hash of
+  // everything that went into them
+  map<string_ref, uint64_t> definitionHashes;
+  uint64_t namesHash = 0;
+  vector<cache_log_t*> cacheLogs;
+  bool cacheWarned = false;
+  uint64_t definitionHash(string_ref id);
+  string cacheKey(const pattern_element_t& tok, char kind);
+  string cachePath(const string& key);
+  void writeCacheSymbol(ir_writer& out, trans_sym_t sym);
+  trans_sym_t readCacheSymbol(ir_reader& in);
+  void writeCacheFilter(ir_writer& out, const tag_filter_t& filter);
+  // set while --jobs has sub-transducers built ahead of time
+  prebuilt_store_t* prebuilt = nullptr;
+  bool caching() const { return prebuilt != nullptr || !cacheDir.empty(); }
+  bool loadCached(const string& key, vector<Transducer*>& trans);
+  bool readCached(const string& key, const char* bytes, size_t length, vector<Transducer*>& trans);
+  string encodeCached(const string& key, const cache_log_t& log, const vector<Transducer*>& trans);
+  void saveCached(const string& key, const cache_log_t& log, const vector<Transducer*>& trans);
+
+  name_kind_t nameKind(string_ref n) const;
+  pattern_element_t sharedLexiconToken(pattern_element_t tok) const;
+  element_id_t elementId(const pattern_element_t& tok);
+  element_id_t derivedId(element_id_t id, char kind);
   bool isLexiconToken(const pattern_element_t& tok);
-  vector<int> determineFreedom(pattern_t& pat);
+  vector<int> determineFreedom(const pattern_t& pat, const line_info_t& info);
+  bool isSharableLine(const pattern_line_t& line);
+  void distributeTagOps(bool usingFlags);
+  void analyzePatterns();
   map<string_ref, unsigned int> matchedParts;
+  void minimizeTransducer(Transducer* trans);
   void applyMode(Transducer* trans, RepeatMode mode);
-  void insertEntry(Transducer* trans, const lex_seg_t &seg);
+  void insertEntry(Transducer* trans, const seg_view_t &seg, acyclic_builder_t* paths = nullptr);
+  void entryPairs(const seg_view_t &seg, vector<int>& tags);
   void appendLexicon(string_ref lexicon_id, const vector<entry_t> &to_append);
   Transducer* getLexiconTransducer(pattern_element_t tok, unsigned int entry_index, bool free);
-  void buildPattern(int state, Transducer* t, const pattern_t& pat, vector<int> is_free, unsigned int pos);
+  bool buildLexiconEntries(const pattern_element_t& tok, bool free, unsigned int begin, unsigned int end, vector<Transducer*>& trans);
+  vector<pair<unsigned int, unsigned int>> lexiconShards(unsigned int count) const;
+  string shardKey(const string& key, unsigned int begin) const;
+  bool loadShard(const string& key, unsigned int begin, vector<Transducer*>& trans);
+  bool mergeShard(vector<Transducer*>& trans, const vector<Transducer*>& part, bool free);
+  void buildPattern(int state, Transducer* t, const pattern_t& pat, const vector<int>& is_free, unsigned int pos, suffix_memo_t& memo);
+  void resolvePatternLine(const pattern_line_t& line, unsigned int pos, vector<vector<Transducer*>>& parts);
+  void buildPatternLine(Transducer* t, const pattern_line_t& line);
+  void stageMinimize(Transducer* t, size_t& limit);
   Transducer* buildPattern(const pattern_element_t &tok);
   Transducer* buildPatternWithFlags(const pattern_element_t &tok, int pattern_start_state);
+  void forkFrom(const LexdCompiler& main);
+  void forgetBuilt();
+  size_t prebuildLexicon(prebuild_graph_t& graph, const pattern_element_t& tok, char kind);
+  void prebuildPatterns(const pattern_element_t& start);
+  void prebuild(prebuild_graph_t& graph);
+  void buildNode(const prebuild_node_t& node);
   trans_sym_t alphabet_lookup(const UnicodeString &symbol);
   trans_sym_t alphabet_lookup(trans_sym_t l, trans_sym_t r);
+  // caches in front of the Alphabet: multichar symbol text, symbol
+  // pairs packed as (l << 32 | r), and flag diacritics by type and
+  // (flag << 32 | value)
+  name_table symbolNames;
+  vector<trans_sym_t> symbolIds;
+  unordered_map<uint64_t, trans_sym_t> pairIds;
+  unordered_map<uint64_t, trans_sym_t> flagIds[Clear + 1];
 
   int insertPreTags(Transducer* t, int state, tag_filter_t &tags);
   int insertPostTags(Transducer* t, int state, tag_filter_t &tags);
   void encodeFlag(UnicodeString& str, int flag);
   trans_sym_t getFlag(FlagDiacriticType type, string_ref flag, unsigned int value);
   Transducer* getLexiconTransducerWithFlags(pattern_element_t& tok, bool free);
+  bool buildLexiconEntriesWithFlags(const pattern_element_t& tok, bool free, unsigned int begin, unsigned int end, Transducer* trans);
 
   void buildAllLexicons();
   int buildPatternSingleLexicon(pattern_element_t tok, int start_state);
@@ -428,9 +744,33 @@ public:
   {
     verbose = val;
   }
+  void setJobs(unsigned int val)
+  {
+    jobs = val;
+  }
+  void setMinimizer(MinimizerType val)
+  {
+    minimizer = val;
+  }
+  void setStageStates(size_t val)
+  {
+    stageStates = val;
+  }
+  void setIRInput(const string& path)
+  {
+    irInput = path;
+  }
+  void setIROutput(const string& path)
+  {
+    irOutput = path;
+  }
+  void setCacheDir(const string& path)
+  {
+    cacheDir = path;
+  }
   Transducer* buildTransducer(bool usingFlags);
   Transducer* buildTransducerSingleLexicon();
-  void readFile(UFILE* infile);
+  void readFile(FILE* infile);
   void printStatistics() const;
 };
 
@@ -0,0 +1,55 @@
+#include "lexer.h"
+#include "icu-iter.h"
+#include <array>
+
+using namespace std;
+using namespace icu;
+
+static constexpr uint16_t classify(unsigned int c)
+{
+  switch(c)
+  {
+    case ' ': return CC_SPACE;
+    case ':': return CC_COLON;
+    case '(': return CC_LPAREN;
+    case ')': return CC_RPAREN;
+    case '[': return CC_LBRACKET;
+    case ']': return CC_RBRACKET;
+    case '?':
+    case '*':
+    case '+': return CC_MODIFIER;
+    case '|': return CC_PIPE;
+    case '<': return CC_SIEVE | CC_MULTICHAR;
+    case '>': return CC_SIEVE;
+    case '/': return CC_SLASH;
+    case '\\': return CC_ESCAPE;
+    case '{': return CC_MULTICHAR;
+    case ',': return CC_COMMA;
+    default: return CC_NONE;
+  }
+}
+
+static constexpr array<uint16_t, 128> make_class_table()
+{
+  array<uint16_t, 128> table {};
+  for(unsigned int c = 0; c < 128; c++)
+    table[c] = classify(c);
+  return table;
+}
+
+static constexpr array<uint16_t, 128> class_table = make_class_table();
+
+lexed_line::lexed_line(const UnicodeString &s)
+  : s(&s)
+{
+  _units.reserve((size_t)s.length());
+  for(charspan_iter it(s); !it.at_end(); ++it)
+  {
+    lex_unit_t u;
+    u.start = it.span().first;
+    u.end = it.span().second;
+    u.lead = s[u.start];
+    u.cls = (u.end - u.start == 1 && u.lead < 128) ? class_table[u.lead] : (uint16_t)CC_NONE;
+    _units.push_back(u);
+  }
+}
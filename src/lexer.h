@@ -0,0 +1,122 @@
+#ifndef _LEXD_LEXER_H_
+#define _LEXD_LEXER_H_
+
+#include <unicode/unistr.h>
+#include <unicode/brkiter.h>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Character classes of the single-code-unit tokens the parsers care about.
+// Tokens of more than one code unit (characters with combining marks,
+// surrogate pairs) never have a class.
+enum char_class : uint16_t
+{
+  CC_NONE      = 0,
+  CC_SPACE     = 1 << 0,
+  CC_COLON     = 1 << 1,
+  CC_LPAREN    = 1 << 2,
+  CC_RPAREN    = 1 << 3,
+  CC_LBRACKET  = 1 << 4,
+  CC_RBRACKET  = 1 << 5,
+  CC_MODIFIER  = 1 << 6,  // ? * +
+  CC_PIPE      = 1 << 7,
+  CC_SIEVE     = 1 << 8,  // < >
+  CC_SLASH     = 1 << 9,
+  CC_ESCAPE    = 1 << 10, // backslash
+  CC_MULTICHAR = 1 << 11, // { and < open multichar symbols
+  CC_COMMA     = 1 << 12,
+
+  // characters which end a lexicon or pattern name
+  CC_NAME_BOUNDARY = CC_SPACE | CC_COLON | CC_LPAREN | CC_RPAREN |
+                     CC_LBRACKET | CC_RBRACKET | CC_MODIFIER | CC_PIPE |
+                     CC_SIEVE,
+  // characters which end a token sequence inside a regex
+  CC_REGEX_BOUNDARY = CC_LPAREN | CC_RPAREN | CC_PIPE | CC_SLASH,
+};
+
+struct lex_unit_t {
+  int32_t start;
+  int32_t end;
+  UChar lead;
+  uint16_t cls;
+};
+
+// A line split into grapheme clusters, each tagged with its class.
+// Lines are lexed once and then read by the parsers through token_iter.
+class lexed_line
+{
+  private:
+    const icu::UnicodeString *s;
+    std::vector<lex_unit_t> _units;
+  public:
+    explicit lexed_line(const icu::UnicodeString &s);
+    const icu::UnicodeString &string() const { return *s; }
+    const std::vector<lex_unit_t> &units() const { return _units; }
+    size_t size() const { return _units.size(); }
+};
+
+class token_iter
+{
+  private:
+    const lexed_line *l;
+    size_t i;
+  public:
+    token_iter(const lexed_line &l) : l(&l), i(0) {}
+
+    bool at_end() const { return i >= l->size(); }
+    token_iter &operator++()
+    {
+      if(!at_end()) i++;
+      return *this;
+    }
+    token_iter operator++(int)
+    {
+      token_iter other = *this;
+      ++*this;
+      return other;
+    }
+    token_iter &operator--()
+    {
+      if(i > 0) i--;
+      return *this;
+    }
+    token_iter operator--(int)
+    {
+      token_iter other = *this;
+      --*this;
+      return other;
+    }
+    token_iter end() const
+    {
+      token_iter other = *this;
+      other.i = l->size();
+      return other;
+    }
+    // same convention as charspan_iter: the end position is (length, DONE)
+    std::pair<int, int> span() const
+    {
+      if(at_end())
+        return std::make_pair(l->string().length(), (int)icu::BreakIterator::DONE);
+      return std::make_pair(l->units()[i].start, l->units()[i].end);
+    }
+    int length() const
+    {
+      return at_end() ? 0 : l->units()[i].end - l->units()[i].start;
+    }
+    // first code unit of the current token, 0 at the end of the line
+    UChar lead() const { return at_end() ? 0 : l->units()[i].lead; }
+    uint16_t cls() const { return at_end() ? (uint16_t)CC_NONE : l->units()[i].cls; }
+    bool in(uint16_t mask) const { return (cls() & mask) != 0; }
+    bool is(UChar c) const { return length() == 1 && lead() == c; }
+    bool starts(UChar c) const { return !at_end() && lead() == c; }
+    icu::UnicodeString operator*() const
+    {
+      auto sp = span();
+      return l->string().tempSubStringBetween(sp.first, sp.second);
+    }
+    bool operator==(const token_iter &other) const { return l == other.l && i == other.i; }
+    bool operator!=(const token_iter &other) const { return !(*this == other); }
+};
+
+#endif
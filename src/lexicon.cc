@@ -0,0 +1,117 @@
+#include "lexdcompiler.h"
+#include <algorithm>
+
+using namespace std;
+
+const tags_t seg_view_t::no_tags;
+
+uint32_t
+lexicon_t::tag_table_t::intern(const tags_t &tags)
+{
+  vector<uint32_t> &ids = index[tags.hash()];
+  for(uint32_t id : ids)
+    if(signatures[id] == tags)
+      return id;
+  ids.push_back((uint32_t)signatures.size());
+  signatures.push_back(tags);
+  return ids.back();
+}
+
+void
+lexicon_t::chunk_t::add(const entry_t &entry)
+{
+  for(const lex_seg_t &seg : entry)
+  {
+    if(seg.regex != nullptr)
+      regexes[tag_ids.size()] = seg.regex;
+    pool.insert(pool.end(), seg.left.symbols.begin(), seg.left.symbols.end());
+    offsets.push_back((uint32_t)pool.size());
+    pool.insert(pool.end(), seg.right.symbols.begin(), seg.right.symbols.end());
+    offsets.push_back((uint32_t)pool.size());
+    tag_ids.push_back(tags.intern(seg.tags));
+  }
+}
+
+void
+lexicon_t::mapTags(chunk_ref_t &ref, size_t from)
+{
+  for(size_t i = from; i < ref.chunk->tags.signatures.size(); i++)
+    ref.tag_ids.push_back(tags.intern(ref.chunk->tags.signatures[i]));
+}
+
+void
+lexicon_t::add(const entry_t &entry)
+{
+  if(_parts == 0)
+    _parts = (unsigned int)entry.size();
+  if(chunks.empty())
+    chunks.push_back(chunk_ref_t{make_shared<chunk_t>(), {}, 0});
+  // the last entries are in the first chunk stored
+  chunk_ref_t &ref = chunks.front();
+  if(ref.chunk.use_count() > 1)
+    ref.chunk = make_shared<chunk_t>(*ref.chunk);
+  const size_t known = ref.chunk->tags.signatures.size();
+  ref.chunk->add(entry);
+  mapTags(ref, known);
+  for(chunk_ref_t &c : chunks)
+    c.end += entry.size();
+}
+
+void
+lexicon_t::prepend(const lexicon_t &other)
+{
+  if(_parts == 0)
+    _parts = other._parts;
+  const size_t base = segments();
+  for(const chunk_ref_t &o : other.chunks)
+  {
+    chunks.push_back(chunk_ref_t{o.chunk, {}, base + o.end});
+    mapTags(chunks.back(), 0);
+  }
+}
+
+bool
+lexicon_t::shares(const lexicon_t &other) const
+{
+  if(chunks.size() != other.chunks.size())
+    return false;
+  for(size_t i = 0; i < chunks.size(); i++)
+    if(chunks[i].chunk != other.chunks[i].chunk)
+      return false;
+  return true;
+}
+
+const lexicon_t::chunk_ref_t &
+lexicon_t::locate(size_t &k) const
+{
+  if(chunks.size() == 1)
+    return chunks[0];
+  // counting back from the last segment walks the chunks in the order
+  // they are stored
+  const size_t total = segments();
+  const size_t back = total - 1 - k;
+  auto it = upper_bound(chunks.begin(), chunks.end(), back,
+                        [](size_t v, const chunk_ref_t &c) { return v < c.end; });
+  k -= total - it->end;
+  return *it;
+}
+
+seg_view_t
+lexicon_t::segment(size_t entry, unsigned int part) const
+{
+  size_t k = entry * _parts + part;
+  const chunk_t &chunk = *locate(k).chunk;
+  seg_view_t seg;
+  seg.left = chunk.pool.data() + chunk.offsets[2*k];
+  seg.left_len = chunk.offsets[2*k+1] - chunk.offsets[2*k];
+  seg.right = chunk.pool.data() + chunk.offsets[2*k+1];
+  seg.right_len = chunk.offsets[2*k+2] - chunk.offsets[2*k+1];
+  seg.tags = &chunk.tags.signatures[chunk.tag_ids[k]];
+  if(!chunk.regexes.empty())
+  {
+    auto it = chunk.regexes.find(k);
+    if(it != chunk.regexes.end())
+      seg.regex = it->second;
+  }
+  return seg;
+}
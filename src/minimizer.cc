@@ -0,0 +1,524 @@
+#include "minimizer.h"
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+struct dfa_t {
+  // the transitions of each state as (label, state), in order of label
+  vector<vector<pair<int, uint32_t>>> edges;
+  vector<bool> final;
+};
+
+// the subsets of a batch are looked at this many at a time
+#define SUBSET_BATCH 16384
+// and split between threads if there are at least this many per thread
+#define SUBSET_PER_THREAD 256
+
+// scratch space for finding the successors of a subset
+struct subset_scratch_t {
+  vector<uint32_t> mark;
+  uint32_t stamp = 0;
+  map<int, vector<uint32_t>> next;
+};
+
+// Subset construction, treating label 0 as epsilon. The states come out
+// numbered from 0, the initial state, in the order they are found.
+// Subsets are handled in batches of those found so far: the successors
+// of each subset in a batch only depend on the NFA, so they're worked
+// out on up to `threads` threads, and then interned in order, which
+// numbers them exactly as doing one subset at a time would.
+bool
+determinize(Transducer *t, dfa_t &dfa, unsigned int threads)
+{
+  auto &transitions = t->getTransitions();
+  unordered_map<int, uint32_t> index;
+  for(auto &state : transitions)
+    index.emplace(state.first, (uint32_t)index.size());
+  vector<vector<pair<int, uint32_t>>> nfa(index.size());
+  for(auto &state : transitions)
+  {
+    auto &out = nfa[index[state.first]];
+    for(auto &tr : state.second)
+    {
+      auto dest = index.find(tr.second.first);
+      if(tr.second.second != 0 || dest == index.end())
+        return false;
+      out.emplace_back(tr.first, dest->second);
+    }
+  }
+  vector<bool> nfa_final(index.size(), false);
+  for(auto &fin : t->getFinals())
+  {
+    auto state = index.find(fin.first);
+    if(fin.second != 0 || state == index.end())
+      return false;
+    nfa_final[state->second] = true;
+  }
+  auto initial = index.find(t->getInitial());
+  if(initial == index.end())
+    return false;
+
+  auto closure = [&nfa](subset_scratch_t &sc, vector<uint32_t> &set) {
+    sc.stamp++;
+    for(uint32_t s : set)
+      sc.mark[s] = sc.stamp;
+    for(size_t i = 0; i < set.size(); i++)
+      for(auto &e : nfa[set[i]])
+        if(e.first == 0 && sc.mark[e.second] != sc.stamp)
+        {
+          sc.mark[e.second] = sc.stamp;
+          set.push_back(e.second);
+        }
+    sort(set.begin(), set.end());
+  };
+  // the closed subset reached on each label, in order of label
+  auto successors = [&nfa, &closure](subset_scratch_t &sc, const vector<uint32_t> &set,
+                                     vector<pair<int, vector<uint32_t>>> &out) {
+    sc.next.clear();
+    for(uint32_t s : set)
+      for(auto &e : nfa[s])
+        if(e.first != 0)
+          sc.next[e.first].push_back(e.second);
+    for(auto &n : sc.next)
+    {
+      auto &next = n.second;
+      sort(next.begin(), next.end());
+      next.erase(unique(next.begin(), next.end()), next.end());
+      closure(sc, next);
+      out.emplace_back(n.first, std::move(next));
+    }
+  };
+  unordered_map<string, uint32_t> subsets;
+  vector<vector<uint32_t>> sets;
+  auto intern = [&](const vector<uint32_t> &set) -> uint32_t {
+    string key((const char*)set.data(), set.size() * sizeof(uint32_t));
+    auto it = subsets.emplace(key, (uint32_t)sets.size());
+    if(it.second)
+    {
+      sets.push_back(set);
+      dfa.edges.emplace_back();
+      bool final = false;
+      for(uint32_t s : set)
+        final = final || nfa_final[s];
+      dfa.final.push_back(final);
+    }
+    return it.first->second;
+  };
+
+  vector<subset_scratch_t> scratch(max(1u, threads));
+  for(auto &sc : scratch)
+    sc.mark.assign(nfa.size(), 0);
+  vector<uint32_t> start(1, initial->second);
+  closure(scratch[0], start);
+  intern(start);
+  vector<vector<pair<int, vector<uint32_t>>>> found;
+  for(size_t begin = 0; begin < sets.size();)
+  {
+    const size_t end = min(sets.size(), begin + SUBSET_BATCH);
+    found.assign(end - begin, vector<pair<int, vector<uint32_t>>>());
+    auto work = [&](size_t from, size_t to, subset_scratch_t &sc) {
+      for(size_t i = from; i < to; i++)
+      {
+        successors(sc, sets[i], found[i - begin]);
+        // only the key is needed from here on
+        vector<uint32_t>().swap(sets[i]);
+      }
+    };
+    const size_t workers = max<size_t>(1, min<size_t>(scratch.size(), (end - begin) / SUBSET_PER_THREAD));
+    if(workers == 1)
+      work(begin, end, scratch[0]);
+    else
+    {
+      vector<thread> pool;
+      for(size_t w = 0; w < workers; w++)
+        pool.emplace_back(work, begin + (end - begin) * w / workers,
+                          begin + (end - begin) * (w + 1) / workers, ref(scratch[w]));
+      for(auto &th : pool)
+        th.join();
+    }
+    for(size_t i = begin; i < end; i++)
+      for(auto &n : found[i - begin])
+      {
+        const uint32_t dest = intern(n.second);
+        dfa.edges[i].emplace_back(n.first, dest);
+      }
+    begin = end;
+  }
+  return true;
+}
+
+// Drops the states no final state can be reached from, and renumbers
+// the rest breadth-first from the initial state.
+void
+trim(dfa_t &dfa)
+{
+  const size_t n = dfa.edges.size();
+  vector<vector<uint32_t>> back(n);
+  for(size_t s = 0; s < n; s++)
+    for(auto &e : dfa.edges[s])
+      back[e.second].push_back((uint32_t)s);
+  vector<bool> live(n, false);
+  vector<uint32_t> todo;
+  for(size_t s = 0; s < n; s++)
+    if(dfa.final[s])
+    {
+      live[s] = true;
+      todo.push_back((uint32_t)s);
+    }
+  while(!todo.empty())
+  {
+    uint32_t s = todo.back();
+    todo.pop_back();
+    for(uint32_t p : back[s])
+      if(!live[p])
+      {
+        live[p] = true;
+        todo.push_back(p);
+      }
+  }
+  dfa_t out;
+  out.edges.emplace_back();
+  out.final.push_back(dfa.final[0]);
+  if(!live[0])
+  {
+    dfa = out;
+    return;
+  }
+  vector<uint32_t> renum(n, UINT32_MAX);
+  renum[0] = 0;
+  deque<uint32_t> queue(1, 0);
+  while(!queue.empty())
+  {
+    uint32_t s = queue.front();
+    queue.pop_front();
+    for(auto &e : dfa.edges[s])
+    {
+      if(!live[e.second])
+        continue;
+      if(renum[e.second] == UINT32_MAX)
+      {
+        renum[e.second] = (uint32_t)out.edges.size();
+        out.edges.emplace_back();
+        out.final.push_back(dfa.final[e.second]);
+        queue.push_back(e.second);
+      }
+      out.edges[renum[s]].emplace_back(e.first, renum[e.second]);
+    }
+  }
+  dfa = out;
+}
+
+// The height of each state, the length of the longest path from it, or
+// false if there is a cycle.
+bool
+heights(const dfa_t &dfa, vector<uint32_t> &height)
+{
+  const size_t n = dfa.edges.size();
+  // 0 unvisited, 1 on the stack, 2 done
+  vector<char> state(n, 0);
+  height.assign(n, 0);
+  vector<pair<uint32_t, size_t>> stack;
+  stack.emplace_back(0, 0);
+  state[0] = 1;
+  while(!stack.empty())
+  {
+    auto &top = stack.back();
+    const uint32_t s = top.first;
+    if(top.second < dfa.edges[s].size())
+    {
+      const uint32_t d = dfa.edges[s][top.second++].second;
+      if(state[d] == 1)
+        return false;
+      if(state[d] == 0)
+      {
+        state[d] = 1;
+        stack.emplace_back(d, 0);
+      }
+      continue;
+    }
+    for(auto &e : dfa.edges[s])
+      height[s] = max(height[s], height[e.second] + 1);
+    state[s] = 2;
+    stack.pop_back();
+  }
+  return true;
+}
+
+// a state's final flag and the classes its transitions lead to
+void
+signature(const dfa_t &dfa, uint32_t s, const vector<uint32_t> &cls, string &key)
+{
+  key.assign(1, (char)dfa.final[s]);
+  for(auto &e : dfa.edges[s])
+  {
+    key.append((const char*)&e.first, sizeof(int));
+    key.append((const char*)&cls[e.second], sizeof(uint32_t));
+  }
+}
+
+// Revuz: equivalent states have the same height, so going up from the
+// states without transitions, every state's successors already have
+// their final classes when it gets to it.
+uint32_t
+revuz(const dfa_t &dfa, const vector<uint32_t> &height, vector<uint32_t> &cls)
+{
+  const size_t n = dfa.edges.size();
+  vector<uint32_t> order(n);
+  for(size_t s = 0; s < n; s++)
+    order[s] = (uint32_t)s;
+  stable_sort(order.begin(), order.end(), [&height](uint32_t a, uint32_t b) {
+    return height[a] < height[b];
+  });
+  cls.assign(n, 0);
+  unordered_map<string, uint32_t> registry;
+  string key;
+  for(uint32_t s : order)
+  {
+    signature(dfa, s, cls, key);
+    cls[s] = registry.emplace(key, (uint32_t)registry.size()).first->second;
+  }
+  return (uint32_t)registry.size();
+}
+
+// A refinable partition of 0..n-1, after Valmari and Lehtinen (2008).
+// The elements of each set are contiguous in `elems`, with the ones
+// marked since the last split() at the front.
+struct partition_t {
+  vector<uint32_t> elems, loc, set, first, past, marked, touched;
+  uint32_t count;
+
+  explicit partition_t(uint32_t n)
+    : elems(n), loc(n), set(n, 0), first(n + 1, 0), past(n + 1, 0),
+      marked(n + 1, 0), count(n > 0 ? 1 : 0)
+  {
+    for(uint32_t e = 0; e < n; e++)
+      elems[e] = loc[e] = e;
+    past[0] = n;
+  }
+
+  void mark(uint32_t e)
+  {
+    const uint32_t s = set[e];
+    const uint32_t i = loc[e];
+    const uint32_t j = first[s] + marked[s];
+    elems[i] = elems[j];
+    loc[elems[i]] = i;
+    elems[j] = e;
+    loc[e] = j;
+    if(marked[s]++ == 0)
+      touched.push_back(s);
+  }
+
+  // Splits each touched set into its marked and unmarked elements. The
+  // smaller part gets the new number, so that no element is moved into
+  // a new set more than log n times.
+  void split()
+  {
+    for(uint32_t s : touched)
+    {
+      const uint32_t j = first[s] + marked[s];
+      marked[s] = 0;
+      if(j == past[s])
+        continue;
+      if(j - first[s] <= past[s] - j)
+      {
+        first[count] = first[s];
+        past[count] = first[s] = j;
+      }
+      else
+      {
+        past[count] = past[s];
+        first[count] = past[s] = j;
+      }
+      for(uint32_t i = first[count]; i < past[count]; i++)
+        set[elems[i]] = count;
+      count++;
+    }
+    touched.clear();
+  }
+};
+
+// Valmari and Lehtinen's refinement, which is Hopcroft's algorithm for
+// transition functions that needn't be total. Alongside the blocks of
+// states there is a partition of the transitions, starting out split by
+// label. Each set of transitions, in turn, splits the blocks by whether
+// their states have one of its transitions; each new block then splits
+// the sets of transitions by whether they lead into it. Since the first
+// block never needs to be a splitter and later ones are the smaller
+// half of what they were split from, this is O(m log n).
+uint32_t
+refine(const dfa_t &dfa, vector<uint32_t> &cls)
+{
+  const uint32_t n = (uint32_t)dfa.edges.size();
+  vector<uint32_t> tail, head;
+  vector<int> label;
+  for(uint32_t s = 0; s < n; s++)
+    for(auto &e : dfa.edges[s])
+    {
+      tail.push_back(s);
+      label.push_back(e.first);
+      head.push_back(e.second);
+    }
+  const uint32_t m = (uint32_t)tail.size();
+
+  partition_t blocks(n);
+  for(uint32_t s = 0; s < n; s++)
+    if(dfa.final[s])
+      blocks.mark(s);
+  blocks.split();
+
+  partition_t cords(m);
+  stable_sort(cords.elems.begin(), cords.elems.end(), [&label](uint32_t a, uint32_t b) {
+    return label[a] < label[b];
+  });
+  cords.count = 0;
+  for(uint32_t i = 0; i < m; i++)
+  {
+    const uint32_t t = cords.elems[i];
+    if(i == 0 || label[t] != label[cords.elems[i-1]])
+    {
+      if(i > 0)
+        cords.past[cords.count - 1] = i;
+      cords.first[cords.count++] = i;
+    }
+    cords.set[t] = cords.count - 1;
+    cords.loc[t] = i;
+  }
+  if(m > 0)
+    cords.past[cords.count - 1] = m;
+
+  // the transitions into each state
+  vector<uint32_t> in_first(n + 1, 0), in(m);
+  for(uint32_t t = 0; t < m; t++)
+    in_first[head[t] + 1]++;
+  for(uint32_t s = 0; s < n; s++)
+    in_first[s + 1] += in_first[s];
+  {
+    vector<uint32_t> fill(in_first.begin(), in_first.end() - 1);
+    for(uint32_t t = 0; t < m; t++)
+      in[fill[head[t]]++] = t;
+  }
+
+  uint32_t b = 1;
+  for(uint32_t c = 0; c < cords.count; c++)
+  {
+    for(uint32_t i = cords.first[c]; i < cords.past[c]; i++)
+      blocks.mark(tail[cords.elems[i]]);
+    blocks.split();
+    for(; b < blocks.count; b++)
+    {
+      for(uint32_t i = blocks.first[b]; i < blocks.past[b]; i++)
+      {
+        const uint32_t s = blocks.elems[i];
+        for(uint32_t j = in_first[s]; j < in_first[s + 1]; j++)
+          cords.mark(in[j]);
+      }
+      cords.split();
+    }
+  }
+  cls = blocks.set;
+  return blocks.count;
+}
+
+}
+
+bool
+minimize_transducer(Transducer *t, unsigned int threads)
+{
+  dfa_t dfa;
+  if(!determinize(t, dfa, threads))
+    return false;
+  trim(dfa);
+  vector<uint32_t> height, cls;
+  uint32_t count;
+  if(heights(dfa, height))
+    count = revuz(dfa, height, cls);
+  else
+    count = refine(dfa, cls);
+
+  Transducer m;
+  vector<int> state(count, -1);
+  vector<uint32_t> rep(count, UINT32_MAX);
+  for(size_t s = 0; s < cls.size(); s++)
+    if(rep[cls[s]] == UINT32_MAX)
+      rep[cls[s]] = (uint32_t)s;
+  state[cls[0]] = m.getInitial();
+  deque<uint32_t> queue(1, cls[0]);
+  while(!queue.empty())
+  {
+    const uint32_t c = queue.front();
+    queue.pop_front();
+    const uint32_t s = rep[c];
+    if(dfa.final[s])
+      m.setFinal(state[c]);
+    for(auto &e : dfa.edges[s])
+    {
+      const uint32_t d = cls[e.second];
+      if(state[d] == -1)
+      {
+        state[d] = m.newState();
+        queue.push_back(d);
+      }
+      m.linkStates(state[c], state[d], e.first);
+    }
+  }
+  *t = m;
+  return true;
+}
+
+bool
+same_automaton(Transducer *a, Transducer *b)
+{
+  static const multimap<int, pair<int, double>> none;
+  auto &ta = a->getTransitions();
+  auto &tb = b->getTransitions();
+  auto out = [](map<int, multimap<int, pair<int, double>>> &trans, int s)
+                -> const multimap<int, pair<int, double>>& {
+    auto it = trans.find(s);
+    return (it == trans.end() ? none : it->second);
+  };
+  unordered_map<int, int> ab, ba;
+  deque<pair<int, int>> queue;
+  ab[a->getInitial()] = b->getInitial();
+  ba[b->getInitial()] = a->getInitial();
+  queue.emplace_back(a->getInitial(), b->getInitial());
+  while(!queue.empty())
+  {
+    const int x = queue.front().first;
+    const int y = queue.front().second;
+    queue.pop_front();
+    if(a->getFinals().count(x) != b->getFinals().count(y))
+      return false;
+    auto &ox = out(ta, x);
+    auto &oy = out(tb, y);
+    if(ox.size() != oy.size())
+      return false;
+    for(auto i = ox.begin(), j = oy.begin(); i != ox.end(); i++, j++)
+    {
+      if(i->first != j->first)
+        return false;
+      const int dx = i->second.first;
+      const int dy = j->second.first;
+      auto fx = ab.find(dx);
+      auto fy = ba.find(dy);
+      if(fx == ab.end() && fy == ba.end())
+      {
+        ab[dx] = dy;
+        ba[dy] = dx;
+        queue.emplace_back(dx, dy);
+      }
+      else if(fx == ab.end() || fy == ba.end() || fx->second != dy)
+        return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,22 @@
+#ifndef _LEXD_MINIMIZER_H_
+#define _LEXD_MINIMIZER_H_
+
+#include <lttoolbox/transducer.h>
+
+// lexd's own minimizer, for --minimizer=lexd. The transducer is made
+// deterministic, with the subset construction spread over up to
+// `threads` threads, and trimmed. Then an acyclic one is minimized by
+// Revuz's algorithm (states merged level by level, by height) and
+// anything else by Valmari and Lehtinen's version of Hopcroft's
+// algorithm. The result is numbered in breadth-first order from the
+// initial state, following transitions in order of their labels.
+//
+// Returns false, leaving t alone, if t has weights, which this doesn't
+// handle.
+bool minimize_transducer(Transducer *t, unsigned int threads);
+
+// Whether a and b, both deterministic, are the same but for the
+// numbering of their states.
+bool same_automaton(Transducer *a, Transducer *b);
+
+#endif
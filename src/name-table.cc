@@ -0,0 +1,90 @@
+#include "name-table.h"
+#include <cstring>
+
+using namespace std;
+using namespace icu;
+
+static const size_t ARENA_BLOCK = 16384;
+
+// FNV-1a over UTF-16 code units
+static inline uint32_t
+hash_name(const UChar *s, int32_t len)
+{
+  uint32_t h = 2166136261u;
+  for(int32_t i = 0; i < len; i++)
+  {
+    h ^= (uint32_t)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+name_table::name_table()
+  : slots(64, slot_t {0, 0})
+{
+}
+
+const UChar *
+name_table::store(const UChar *s, int32_t len)
+{
+  const size_t n = (size_t)len;
+  if(n > ARENA_BLOCK / 4)
+  {
+    // long names get a block of their own
+    UChar *chars = new UChar[n];
+    memcpy(chars, s, n * sizeof(UChar));
+    large.push_back(unique_ptr<UChar[]>(chars));
+    return chars;
+  }
+  if(blocks.empty() || block_size - block_used < n)
+  {
+    blocks.push_back(unique_ptr<UChar[]>(new UChar[ARENA_BLOCK]));
+    block_used = 0;
+    block_size = ARENA_BLOCK;
+  }
+  UChar *chars = blocks.back().get() + block_used;
+  if(n > 0)
+    memcpy(chars, s, n * sizeof(UChar));
+  block_used += n;
+  return chars;
+}
+
+void
+name_table::grow()
+{
+  vector<slot_t> bigger(slots.size() * 2, slot_t {0, 0});
+  const size_t mask = bigger.size() - 1;
+  for(const auto &slot : slots)
+  {
+    if(slot.id == 0)
+      continue;
+    size_t i = slot.hash & mask;
+    while(bigger[i].id != 0)
+      i = (i + 1) & mask;
+    bigger[i] = slot;
+  }
+  slots.swap(bigger);
+}
+
+unsigned int
+name_table::intern(const UChar *s, int32_t len)
+{
+  const uint32_t h = hash_name(s, len);
+  const size_t mask = slots.size() - 1;
+  size_t i = h & mask;
+  for(; slots[i].id != 0; i = (i + 1) & mask)
+  {
+    if(slots[i].hash != h)
+      continue;
+    const name_t &n = names[slots[i].id - 1];
+    if(n.length == len && (len == 0 || memcmp(n.chars, s, (size_t)len * sizeof(UChar)) == 0))
+      return slots[i].id - 1;
+  }
+  const unsigned int id = (unsigned int)names.size();
+  names.push_back(name_t {store(s, len), len});
+  slots[i] = slot_t {h, id + 1};
+  // keep the load factor at or below one half
+  if(names.size() * 2 > slots.size())
+    grow();
+  return id;
+}
@@ -0,0 +1,52 @@
+#ifndef _LEXD_NAME_TABLE_H_
+#define _LEXD_NAME_TABLE_H_
+
+#include <unicode/unistr.h>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Interns lexicon, pattern and tag names as dense ids, handed out in
+// order of first appearance starting from 0. Lookups hash the name once
+// and probe an open-addressing table; full comparisons only happen when
+// the stored hashes match. The characters are copied once into an
+// append-only arena, so the views returned by name() stay valid for the
+// lifetime of the table.
+class name_table
+{
+  private:
+    struct slot_t {
+      uint32_t hash;
+      uint32_t id; // id + 1, 0 for an empty slot
+    };
+    struct name_t {
+      const UChar *chars;
+      int32_t length;
+    };
+    std::vector<std::unique_ptr<UChar[]>> blocks;
+    std::vector<std::unique_ptr<UChar[]>> large;
+    size_t block_used = 0;
+    size_t block_size = 0;
+    std::vector<name_t> names;
+    std::vector<slot_t> slots;
+
+    const UChar *store(const UChar *s, int32_t len);
+    void grow();
+  public:
+    name_table();
+    name_table(const name_table &other) = delete;
+
+    unsigned int intern(const UChar *s, int32_t len);
+    unsigned int intern(const icu::UnicodeString &s)
+    {
+      return intern(s.getBuffer(), s.length());
+    }
+    // read-only alias of the stored characters
+    icu::UnicodeString name(unsigned int id) const
+    {
+      return icu::UnicodeString(false, names[id].chars, names[id].length);
+    }
+    size_t size() const { return names.size(); }
+};
+
+#endif
@@ -0,0 +1,194 @@
+#include "source-reader.h"
+#include <unicode/utf8.h>
+#include <unicode/uchar.h>
+#include <cstring>
+#include <cstdint>
+#if HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace icu;
+
+// ASCII whitespace as defined by u_isWhitespace()
+static inline bool ascii_space(unsigned char c)
+{
+  return c == ' ' || (c >= 0x09 && c <= 0x0D) || (c >= 0x1C && c <= 0x1F);
+}
+
+// Bytes that readLine() has to look at individually: anything that might
+// be whitespace, comment and escape markers, and the start of a UTF-8
+// sequence. Everything else is copied straight through.
+static inline bool special_byte(unsigned char c)
+{
+  return c <= ' ' || c >= 0x80 || c == '#' || c == '\\';
+}
+
+// Return the first special byte in [p, end), checking eight bytes at a
+// time where possible.
+static const char *skip_plain(const char *p, const char *end)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  while(end - p >= 8)
+  {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    uint64_t hash = v ^ (ones * '#');
+    uint64_t bslash = v ^ (ones * '\\');
+    uint64_t m = ((v - ones * 0x21) & ~v) |
+                 ((hash - ones) & ~hash) |
+                 ((bslash - ones) & ~bslash) |
+                 v;
+    m &= highs;
+    if(m)
+      return p + (__builtin_ctzll(m) >> 3);
+    p += 8;
+  }
+#endif
+  while(p < end && !special_byte((unsigned char)*p))
+    p++;
+  return p;
+}
+
+source_reader::source_reader(FILE *input)
+  : data(nullptr), size(0), pos(0), mapped(nullptr)
+{
+#if HAVE_MMAP
+  struct stat st;
+  int fd = fileno(input);
+  if(fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+  {
+    void *m = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(m != MAP_FAILED)
+    {
+      mapped = m;
+      data = (const char*)m;
+      size = (size_t)st.st_size;
+      madvise(m, size, MADV_SEQUENTIAL);
+      return;
+    }
+  }
+#endif
+  char chunk[65536];
+  size_t n;
+  while((n = fread(chunk, 1, sizeof(chunk), input)) > 0)
+    buffer.append(chunk, n);
+  data = buffer.data();
+  size = buffer.size();
+}
+
+source_reader::source_reader(const char *bytes, size_t length)
+  : data(bytes), size(length), pos(0), mapped(nullptr)
+{
+}
+
+source_reader::~source_reader()
+{
+#if HAVE_MMAP
+  if(mapped)
+    munmap(mapped, size);
+#endif
+}
+
+bool
+source_reader::at_end() const
+{
+  return pos >= size;
+}
+
+bool
+source_reader::readLine(UnicodeString &line, bool &trailing_escape)
+{
+  if(pos >= size)
+    return false;
+  const char *p = data + pos;
+  const char *end = data + size;
+  const char *eol = (const char*)memchr(p, '\n', (size_t)(end - p));
+  if(eol == nullptr)
+    eol = end;
+  pos = (size_t)(eol - data) + (eol < end ? 1 : 0);
+
+  linebuf.clear();
+  bool escape = false;
+  bool lastWasSpace = false;
+  while(p < eol)
+  {
+    if(!escape)
+    {
+      const char *q = skip_plain(p, eol);
+      if(q != p)
+      {
+        linebuf.append(p, q);
+        lastWasSpace = false;
+        p = q;
+        if(p == eol)
+          break;
+      }
+    }
+    unsigned char b = (unsigned char)*p;
+    if(b >= 0x80)
+    {
+      // decode one code point; supplementary characters become a
+      // surrogate pair, neither half of which counts as whitespace
+      const uint8_t *s = (const uint8_t*)p;
+      int32_t i = 0;
+      UChar32 c;
+      U8_NEXT(s, i, (int32_t)(eol - p), c);
+      p += i;
+      if(c < 0)
+        c = 0xFFFD;
+      if(!escape && c <= 0xFFFF && u_isWhitespace(c))
+      {
+        if(!linebuf.empty() && !lastWasSpace)
+          linebuf += u' ';
+        lastWasSpace = !linebuf.empty();
+        continue;
+      }
+      if(c <= 0xFFFF)
+        linebuf += (char16_t)c;
+      else
+      {
+        linebuf += (char16_t)U16_LEAD(c);
+        linebuf += (char16_t)U16_TRAIL(c);
+      }
+      escape = false;
+      lastWasSpace = false;
+      continue;
+    }
+    p++;
+    if(escape)
+    {
+      linebuf += (char16_t)b;
+      escape = false;
+      lastWasSpace = false;
+    }
+    else if(b == '\\')
+    {
+      linebuf += u'\\';
+      escape = true;
+      lastWasSpace = false;
+    }
+    else if(b == '#')
+    {
+      break;
+    }
+    else if(ascii_space(b))
+    {
+      if(!linebuf.empty() && !lastWasSpace)
+        linebuf += u' ';
+      lastWasSpace = !linebuf.empty();
+    }
+    else
+    {
+      linebuf += (char16_t)b;
+      lastWasSpace = false;
+    }
+  }
+  trailing_escape = escape;
+  line.setTo(linebuf.data(), (int32_t)linebuf.size());
+  return true;
+}
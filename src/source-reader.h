@@ -0,0 +1,38 @@
+#ifndef _LEXD_SOURCE_READER_H_
+#define _LEXD_SOURCE_READER_H_
+
+#include <unicode/unistr.h>
+#include <cstdio>
+#include <cstddef>
+#include <string>
+
+// Holds an entire .lexd source in memory and hands it out one logical
+// line at a time. Regular files are mapped with mmap(); pipes and stdin
+// are read into a heap buffer instead. Input is assumed to be UTF-8.
+class source_reader
+{
+  private:
+    const char *data;
+    size_t size;
+    size_t pos;
+    void *mapped;
+    std::string buffer;
+    std::u16string linebuf;
+  public:
+    source_reader(FILE *input);
+    source_reader(const char *bytes, size_t length);
+    source_reader(const source_reader &other) = delete;
+    ~source_reader();
+
+    // Read the next line into `line`, with comments removed, runs of
+    // whitespace collapsed to a single space and leading whitespace
+    // dropped. `trailing_escape` is set if the line ends in a lone
+    // backslash. Returns false once the input is exhausted.
+    bool readLine(icu::UnicodeString &line, bool &trailing_escape);
+    bool at_end() const;
+
+    const char *bytes() const { return data; }
+    size_t length() const { return size; }
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _LEXD_STRING_REF_H_
+#define _LEXD_STRING_REF_H_
+
+#include <functional>
+
+// an interned lexicon, pattern or tag name, see name_table
+struct string_ref {
+  unsigned int i;
+  string_ref() : i(0) {}
+  explicit string_ref(unsigned int _i) : i(_i) {}
+  explicit operator unsigned int() const { return i; }
+  bool operator == (string_ref other) const { return i == other.i; }
+  bool operator != (string_ref other) const { return !(*this == other); }
+  bool operator < (string_ref other) const { return i < other.i; }
+  bool operator !() const { return empty(); }
+  string_ref operator || (string_ref other) const {
+    return i ? *this : other;
+  }
+  bool empty() const { return i == 0; }
+  bool valid() const { return i != 0; }
+};
+
+template<>
+struct std::hash<string_ref> {
+  size_t operator()(const string_ref &t) const
+  {
+    return std::hash<unsigned int>()(t.i);
+  }
+};
+
+#endif
@@ -0,0 +1,270 @@
+#include "tag-set.h"
+
+using namespace std;
+
+tag_set::tag_set(initializer_list<string_ref> tags)
+{
+  for(string_ref tag : tags)
+    insert(tag);
+}
+
+void
+tag_set::insert_block(uint32_t pos, block_t blk)
+{
+  if(spill.empty() && n < INLINE_BLOCKS)
+  {
+    for(uint32_t i = n; i > pos; i--)
+      local[i] = local[i-1];
+    local[pos] = blk;
+    n++;
+    return;
+  }
+  if(spill.empty())
+  {
+    spill.assign(local, local + n);
+    n = 0;
+  }
+  spill.insert(spill.begin() + pos, blk);
+}
+
+void
+tag_set::erase_block(uint32_t pos)
+{
+  if(spill.empty())
+  {
+    for(uint32_t i = pos; i + 1 < n; i++)
+      local[i] = local[i+1];
+    n--;
+  }
+  else
+    spill.erase(spill.begin() + pos);
+}
+
+void
+tag_set::assign(const vector<block_t> &blks)
+{
+  if(blks.size() <= INLINE_BLOCKS)
+  {
+    spill.clear();
+    n = (uint32_t)blks.size();
+    for(uint32_t i = 0; i < n; i++)
+      local[i] = blks[i];
+  }
+  else
+  {
+    spill = blks;
+    n = 0;
+  }
+}
+
+size_t
+tag_set::size() const
+{
+  size_t total = 0;
+  const block_t *d = data();
+  for(uint32_t i = 0; i < blocks(); i++)
+    total += (size_t)__builtin_popcountll(d[i].bits);
+  return total;
+}
+
+void
+tag_set::clear()
+{
+  spill.clear();
+  n = 0;
+}
+
+bool
+tag_set::contains(string_ref tag) const
+{
+  const uint32_t index = tag.i >> 6;
+  const block_t *d = data();
+  for(uint32_t i = 0; i < blocks() && d[i].index <= index; i++)
+    if(d[i].index == index)
+      return (d[i].bits >> (tag.i & 63)) & 1;
+  return false;
+}
+
+void
+tag_set::insert(string_ref tag)
+{
+  const uint32_t index = tag.i >> 6;
+  const uint64_t bit = 1ULL << (tag.i & 63);
+  block_t *d = spill.empty() ? local : spill.data();
+  uint32_t i = 0;
+  for(; i < blocks() && d[i].index < index; i++);
+  if(i < blocks() && d[i].index == index)
+    d[i].bits |= bit;
+  else
+    insert_block(i, block_t {index, bit});
+}
+
+void
+tag_set::erase(string_ref tag)
+{
+  const uint32_t index = tag.i >> 6;
+  block_t *d = spill.empty() ? local : spill.data();
+  for(uint32_t i = 0; i < blocks() && d[i].index <= index; i++)
+  {
+    if(d[i].index != index)
+      continue;
+    d[i].bits &= ~(1ULL << (tag.i & 63));
+    if(d[i].bits == 0)
+      erase_block(i);
+    return;
+  }
+}
+
+void
+tag_set::add(const tag_set &other)
+{
+  const block_t *a = data(), *b = other.data();
+  const uint32_t na = blocks(), nb = other.blocks();
+  // the common case: every block of `other` is already here
+  uint32_t i = 0, j = 0;
+  for(; i < na && j < nb; i++)
+  {
+    if(a[i].index == b[j].index)
+      j++;
+    else if(a[i].index > b[j].index)
+      break;
+  }
+  if(j == nb)
+  {
+    block_t *d = spill.empty() ? local : spill.data();
+    for(i = 0, j = 0; j < nb; i++)
+    {
+      if(d[i].index == b[j].index)
+        d[i].bits |= b[j++].bits;
+    }
+    return;
+  }
+  vector<block_t> merged;
+  merged.reserve(na + nb);
+  for(i = 0, j = 0; i < na || j < nb;)
+  {
+    if(j == nb || (i < na && a[i].index < b[j].index))
+      merged.push_back(a[i++]);
+    else if(i == na || b[j].index < a[i].index)
+      merged.push_back(b[j++]);
+    else
+    {
+      merged.push_back(block_t {a[i].index, a[i].bits | b[j].bits});
+      i++;
+      j++;
+    }
+  }
+  assign(merged);
+}
+
+void
+tag_set::remove(const tag_set &other)
+{
+  block_t *d = spill.empty() ? local : spill.data();
+  const block_t *b = other.data();
+  const uint32_t nb = other.blocks();
+  uint32_t out = 0;
+  for(uint32_t i = 0, j = 0; i < blocks(); i++)
+  {
+    block_t blk = d[i];
+    for(; j < nb && b[j].index < blk.index; j++);
+    if(j < nb && b[j].index == blk.index)
+      blk.bits &= ~b[j].bits;
+    if(blk.bits != 0)
+      d[out++] = blk;
+  }
+  if(spill.empty())
+    n = out;
+  else if(out <= INLINE_BLOCKS)
+  {
+    for(uint32_t i = 0; i < out; i++)
+      local[i] = spill[i];
+    spill.clear();
+    n = out;
+  }
+  else
+    spill.resize(out);
+}
+
+bool
+tag_set::subset_of(const tag_set &other) const
+{
+  const block_t *a = data(), *b = other.data();
+  const uint32_t na = blocks(), nb = other.blocks();
+  if(na > nb)
+    return false;
+  uint32_t j = 0;
+  for(uint32_t i = 0; i < na; i++)
+  {
+    for(; j < nb && b[j].index < a[i].index; j++);
+    if(j == nb || b[j].index != a[i].index || (a[i].bits & ~b[j].bits) != 0)
+      return false;
+  }
+  return true;
+}
+
+bool
+tag_set::intersects(const tag_set &other) const
+{
+  const block_t *a = data(), *b = other.data();
+  const uint32_t na = blocks(), nb = other.blocks();
+  for(uint32_t i = 0, j = 0; i < na && j < nb;)
+  {
+    if(a[i].index < b[j].index)
+      i++;
+    else if(b[j].index < a[i].index)
+      j++;
+    else if(a[i++].bits & b[j++].bits)
+      return true;
+  }
+  return false;
+}
+
+size_t
+tag_set::hash() const
+{
+  uint64_t h = 14695981039346656037ULL;
+  const block_t *d = data();
+  for(uint32_t i = 0; i < blocks(); i++)
+  {
+    h = (h ^ d[i].index) * 1099511628211ULL;
+    h = (h ^ d[i].bits) * 1099511628211ULL;
+  }
+  return (size_t)h;
+}
+
+bool
+tag_set::operator==(const tag_set &other) const
+{
+  if(blocks() != other.blocks())
+    return false;
+  const block_t *a = data(), *b = other.data();
+  for(uint32_t i = 0; i < blocks(); i++)
+    if(a[i].index != b[i].index || a[i].bits != b[i].bits)
+      return false;
+  return true;
+}
+
+bool
+tag_set::operator<(const tag_set &other) const
+{
+  const block_t *a = data(), *b = other.data();
+  const uint32_t na = blocks(), nb = other.blocks();
+  for(uint32_t i = 0; i < na && i < nb; i++)
+  {
+    if(a[i].index != b[i].index)
+      // whichever has the earlier block has the smaller next id
+      return a[i].index < b[i].index;
+    const uint64_t diff = a[i].bits ^ b[i].bits;
+    if(diff == 0)
+      continue;
+    // the sequences first differ at the lowest differing bit; the set
+    // that has it is smaller unless the other one ends right there
+    const uint64_t low = diff & -diff;
+    const uint64_t above = ~((low << 1) - 1);
+    if(a[i].bits & low)
+      return (b[i].bits & above) != 0 || i + 1 < nb;
+    return !((a[i].bits & above) != 0 || i + 1 < na);
+  }
+  return na < nb;
+}
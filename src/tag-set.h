@@ -0,0 +1,115 @@
+#ifndef _LEXD_TAG_SET_H_
+#define _LEXD_TAG_SET_H_
+
+#include "string-ref.h"
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <vector>
+
+// A set of tag names as a sparse bitset over their name ids: a sorted
+// list of 64-bit words, each tagged with its offset. Names are interned
+// densely and tags are usually declared close together, so most sets
+// fit in one or two words, which are kept inline. Subset, union and
+// disjointness tests work a word at a time. Iteration is in id order,
+// the same order std::set<string_ref> would give.
+class tag_set
+{
+  public:
+    struct block_t {
+      uint32_t index; // id / 64
+      uint64_t bits;
+    };
+
+    class const_iterator
+    {
+      private:
+        const block_t *b;
+        const block_t *e;
+        uint64_t bits;
+        string_ref cur;
+        void load()
+        {
+          if(bits)
+            cur = string_ref((b->index << 6) | (unsigned int)__builtin_ctzll(bits));
+        }
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef string_ref value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const string_ref* pointer;
+        typedef const string_ref& reference;
+
+        const_iterator(const block_t *b, const block_t *e)
+          : b(b), e(e), bits(b != e ? b->bits : 0) { load(); }
+        const string_ref& operator*() const { return cur; }
+        const string_ref* operator->() const { return &cur; }
+        const_iterator& operator++()
+        {
+          bits &= bits - 1;
+          if(bits == 0 && b != e && ++b != e)
+            bits = b->bits;
+          load();
+          return *this;
+        }
+        const_iterator operator++(int)
+        {
+          const_iterator old = *this;
+          ++*this;
+          return old;
+        }
+        bool operator==(const const_iterator &o) const { return b == o.b && bits == o.bits; }
+        bool operator!=(const const_iterator &o) const { return !(*this == o); }
+    };
+    typedef const_iterator iterator;
+
+  private:
+    static const uint32_t INLINE_BLOCKS = 2;
+    // blocks live in `local` until there are more than INLINE_BLOCKS
+    // of them, and in `spill` from then on
+    uint32_t n = 0;
+    block_t local[INLINE_BLOCKS] = {};
+    std::vector<block_t> spill;
+
+    const block_t *data() const { return spill.empty() ? local : spill.data(); }
+    uint32_t blocks() const { return spill.empty() ? n : (uint32_t)spill.size(); }
+    void insert_block(uint32_t pos, block_t blk);
+    void erase_block(uint32_t pos);
+    void assign(const std::vector<block_t> &blks);
+
+  public:
+    tag_set() = default;
+    tag_set(std::initializer_list<string_ref> tags);
+
+    bool empty() const { return blocks() == 0; }
+    size_t size() const;
+    void clear();
+    bool contains(string_ref tag) const;
+    size_t count(string_ref tag) const { return contains(tag) ? 1 : 0; }
+    void insert(string_ref tag);
+    void erase(string_ref tag);
+    template<typename It>
+    void insert(It first, It last)
+    {
+      for(; first != last; ++first)
+        insert(*first);
+    }
+
+    // in-place union and difference
+    void add(const tag_set &other);
+    void remove(const tag_set &other);
+    bool subset_of(const tag_set &other) const;
+    bool intersects(const tag_set &other) const;
+
+    const_iterator begin() const { return const_iterator(data(), data() + blocks()); }
+    const_iterator end() const { return const_iterator(data() + blocks(), data() + blocks()); }
+
+    size_t hash() const;
+
+    bool operator==(const tag_set &other) const;
+    bool operator!=(const tag_set &other) const { return !(*this == other); }
+    // the same order as comparing the sorted sequences of ids
+    bool operator<(const tag_set &other) const;
+};
+
+#endif